@@ -5,13 +5,25 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
-#include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "bin2video.h"
+#include "kernels.h"
+#include "input.h"
+#include "pipe.h"
 #include "subprocess.h"
 
 #define METADATA_VERSION 2
+// Videos in a YUV format have their format after the frame count. They get
+// their own version, so the rest can still be decoded by older versions.
+#define METADATA_VERSION_FORMAT 3
+
+// The decoder keeps about this many bytes of the scaled image, in whole block
+// rows, instead of the whole frame
+#define DECODE_BAND_SIZE (128 << 10)
+// The pipe from ffmpeg is made this large, so ffmpeg can keep decoding while
+// a band is being decoded
+#define DECODE_PIPE_SIZE (1 << 20)
 
 #define LOAD_UINT32(u8_pt) \
 	(uint32_t)( \
@@ -27,62 +39,59 @@
 	(u8_pt)[3] = (uint32_t)(u32) & 0xFF; \
 }
 
-// array[bits_per_pixel][comp]
-
 static bool did_init_before = false;
-static int bits_per_comp[25][3];
-static double comp_div[25][3];
-
-int get_bit(uint8_t *buffer, int size, int *tbyte, int *tbit, int *idx, bool rev)
-{
-	if (*tbit == 0) {
-		if (*idx == size) {
-			*tbyte = -1;
-			return 0;
-		}
-		*tbyte = buffer[(*idx)++];
-		*tbit = 0;
-	}
-	int ret;
-	if (rev) ret = (*tbyte >> (7 - *tbit)) & 1;
-	else     ret = (*tbyte >> (*tbit)) & 1;
-	(*tbit)++;
-	if (*tbit == 8) {
-		*tbit = 0;
-	}
-	return ret;
-}
-
-void put_bit(uint8_t *buffer, int bit, int *tbyte, int *tbit, int *idx, bool rev) {
-	if (rev) {
-		*tbyte |= bit << (7 - *tbit);
-	}
-	else {
-		*tbyte |= bit << *tbit;
-	}
-	(*tbit)++;
-	if (*tbit == 8) {
-		buffer[(*idx)++] = *tbyte;
-		*tbyte = 0;
-		*tbit = 0;
-	}
-}
 
 struct b2v_context {
 	uint8_t *image;
 	uint8_t *buffer;
 	uint8_t *image_scaled;
+	size_t image_scaled_size;
+	uint8_t *planes; // the whole frame, in the YUV formats
+	size_t planes_size;
+	uint8_t *spare_frame; // the other buffer for the frame, see b2v_next_frame()
+	uint16_t *column_sums; // one scaled line, summed over up to 256 lines
+	uint32_t *block_sums; // one block row
+	uint16_t *copy_sums; // every block of the frame, summed over its copies
+	uint64_t reciprocal; // 2^48 / (sample_size * sample_size), rounded up
+	int sample; // B2V_SAMPLE_AVERAGE, B2V_SAMPLE_CENTER or a core size
+	int sample_offset; // first sampled line and column of a block
+	int sample_size; // sampled lines and columns of a block
+	int copies; // copies of a frame that are combined before decoding
+	int copy; // copy being decoded, from 0 to copies - 1
+	int channels; // bytes per pixel, 3 for RGB24 or 1 for grayscale
+	int format; // B2V_FORMAT_*
+	b2v_upscale_fn upscale;
+	b2v_encode_fn encode;
+	b2v_decode_fn decode;
+	bool isg_mode;
 	int scale;
 	int tbyte;
 	int tbit;
 	int width;
 	int scaled_pad_height;
+	size_t band_size; // bytes of the scaled image to keep, 0 for all of it
+	int band_rows; // block rows kept in image_scaled
 	int height;
 	int bits_per_pixel;
 	size_t buffer_size;
-	size_t bytes_available;
+
+	// Progress through the frame being decoded
+	uint8_t metadata[4];
+	int metadata_idx;
+	int metadata_tbit;
+	int metadata_tbyte;
+	int block_count;
+	int buffer_idx;
 };
 
+// Makes the planes black
+static void b2v_clear_planes(struct b2v_context *ctx) {
+	int lines = ctx->height * ctx->scale + ctx->scaled_pad_height;
+	size_t luma = (size_t)ctx->width * ctx->scale * lines;
+	memset(ctx->planes, 16, luma);
+	memset(ctx->planes + luma, 128, ctx->planes_size - luma);
+}
+
 void b2v_context_realloc(struct b2v_context *ctx) {
 	int blocks = ctx->width * ctx->height;
 
@@ -90,41 +99,134 @@ void b2v_context_realloc(struct b2v_context *ctx) {
 	ctx->buffer_size = (blocks * ctx->bits_per_pixel) / 8 + 1;
 	ctx->buffer = malloc(ctx->buffer_size);
 	
-	if (ctx->image != NULL) free(ctx->image);
-	ctx->image = malloc(blocks * 3);
+	if (ctx->image != ctx->image_scaled) free(ctx->image);
 
-	int pixels = ctx->width * ctx->height * ctx->scale * ctx->scale;
-	int padded_pixels = ctx->width * (ctx->height + ctx->scaled_pad_height) *
-		ctx->scale * ctx->scale;
-	if (ctx->image_scaled != NULL) free(ctx->image_scaled);
-	ctx->image_scaled = malloc(padded_pixels * 3);
-	memset(ctx->image_scaled + pixels * 3, 0, (padded_pixels - pixels) * 3);
+	int scaled_width = ctx->width * ctx->scale;
+	int scaled_pad_height = ctx->scaled_pad_height;
+	ctx->band_rows = ctx->height;
+	if (ctx->format != B2V_FORMAT_RGB) {
+		// Planar frames are kept whole in `planes`, image_scaled only holds the
+		// packed lines of one block row
+		scaled_pad_height = 0;
+		ctx->band_rows = 1;
+	}
+	else if (ctx->band_size != 0) {
+		size_t row_size = (size_t)scaled_width * ctx->scale * ctx->channels;
+		ctx->band_rows = ctx->band_size / row_size;
+		if (ctx->band_rows < 1) {
+			ctx->band_rows = 1;
+		}
+		else if (ctx->band_rows > ctx->height) {
+			ctx->band_rows = ctx->height;
+		}
+	}
+	// Frame buffers are kept when their size doesn't change, the frames
+	// written to ffmpeg may still be in the pipe. Between the metadata frame
+	// and the data frames of the encoder, only the block size changes.
+	int pixels = scaled_width * ctx->band_rows * ctx->scale;
+	int padded_pixels = scaled_width * (ctx->band_rows * ctx->scale +
+		scaled_pad_height);
+	size_t image_scaled_size = (size_t)padded_pixels * ctx->channels;
+	if (image_scaled_size != ctx->image_scaled_size) {
+		free(ctx->image_scaled);
+		ctx->image_scaled = b2v_pipe_alloc(image_scaled_size);
+		ctx->image_scaled_size = image_scaled_size;
+		memset(ctx->image_scaled + pixels * ctx->channels, 0,
+			(padded_pixels - pixels) * ctx->channels);
+		if (ctx->format == B2V_FORMAT_RGB) {
+			free(ctx->spare_frame);
+			ctx->spare_frame = NULL;
+		}
+	}
+
+	size_t planes_size = 0;
+	if (ctx->format != B2V_FORMAT_RGB) {
+		int shift = (ctx->format == B2V_FORMAT_YUV420);
+		int lines = ctx->height * ctx->scale + ctx->scaled_pad_height;
+		size_t luma = (size_t)scaled_width * lines;
+		size_t chroma = (size_t)(scaled_width >> shift) * (lines >> shift);
+		planes_size = luma + chroma * 2;
+	}
+	if (planes_size != ctx->planes_size) {
+		free(ctx->planes);
+		ctx->planes = NULL;
+		ctx->planes_size = planes_size;
+		if (planes_size != 0) {
+			ctx->planes = b2v_pipe_alloc(planes_size);
+			// Black, for the region below the data
+			b2v_clear_planes(ctx);
+		}
+		if (ctx->format != B2V_FORMAT_RGB) {
+			free(ctx->spare_frame);
+			ctx->spare_frame = NULL;
+		}
+	}
+
+	// At a block size of 1, the image doesn't need to be scaled at all, unless
+	// the combined copies or the planes need somewhere to go
+	int row_size = ctx->width * ctx->channels;
+	if ((ctx->scale == 1) && (ctx->copies == 1) &&
+		(ctx->format == B2V_FORMAT_RGB))
+	{
+		ctx->image = ctx->image_scaled;
+	}
+	else {
+		ctx->image = malloc(row_size);
+	}
+
+	ctx->sample_size = ctx->scale;
+	if ((ctx->sample != B2V_SAMPLE_AVERAGE) && (ctx->sample < ctx->scale)) {
+		ctx->sample_size = ctx->sample;
+	}
+	ctx->sample_offset = (ctx->scale - ctx->sample_size) / 2;
+
+	free(ctx->column_sums);
+	free(ctx->block_sums);
+	free(ctx->copy_sums);
+	ctx->column_sums = malloc(scaled_width * ctx->channels *
+		sizeof(*ctx->column_sums));
+	ctx->block_sums = malloc(row_size * sizeof(*ctx->block_sums));
+	ctx->copy_sums = NULL;
+	if (ctx->copies > 1) {
+		ctx->copy_sums = malloc((size_t)blocks * ctx->channels *
+			sizeof(*ctx->copy_sums));
+	}
+	uint64_t area = (uint64_t)ctx->sample_size * ctx->sample_size;
+	ctx->reciprocal = ((1ULL << 48) + area - 1) / area;
+	if (ctx->channels == 1) {
+		// Grayscale images only hold 1 bit per pixel
+		ctx->upscale = b2v_upscale_gray;
+		ctx->encode = b2v_encode_gray_kernel(ctx->isg_mode);
+		ctx->decode = b2v_decode_gray_kernel(ctx->isg_mode);
+	}
+	else {
+		ctx->upscale = b2v_upscale_kernel(ctx->scale);
+		ctx->encode = b2v_encode_kernel(ctx->bits_per_pixel, ctx->isg_mode);
+		ctx->decode = b2v_decode_kernel(ctx->bits_per_pixel, ctx->isg_mode);
+	}
 
 	ctx->tbit = 0;
 	ctx->tbyte = 0;
-	ctx->bytes_available = 0;
 }
 
 void b2v_context_init(struct b2v_context *ctx, int width, int height,
-	int bits_per_pixel, int scale, int pad_height)
+	int bits_per_pixel, int channels, int format, int scale, int pad_height,
+	size_t band_size, int sample, bool isg_mode)
 {
 	if (!did_init_before) {
 		did_init_before = true;
-		for (int bits_per_pixel=0; bits_per_pixel<=24; bits_per_pixel++) {
-			for (int i=0; i<3; i++) {
-				bits_per_comp[bits_per_pixel][i] = bits_per_pixel / 3;
-				if ((bits_per_pixel % 3) > i) {
-					bits_per_comp[bits_per_pixel][i] += 1;
-				}
-				comp_div[bits_per_pixel][i] = 255.0 /
-					(double)((1 << bits_per_comp[bits_per_pixel][i]) - 1);
-			}
-		}
+		b2v_kernels_init();
 	}
 
 	memset(ctx, 0, sizeof(*ctx));
 	ctx->width = width;
 	ctx->scaled_pad_height = pad_height;
+	ctx->band_size = band_size;
+	ctx->copies = 1;
+	ctx->channels = channels;
+	ctx->format = format;
+	ctx->sample = sample;
+	ctx->isg_mode = isg_mode;
 	ctx->height = height;
 	ctx->scale = scale;
 	ctx->bits_per_pixel = bits_per_pixel;
@@ -133,188 +235,411 @@ void b2v_context_init(struct b2v_context *ctx, int width, int height,
 
 void b2v_context_destroy(struct b2v_context *ctx) {
 	free(ctx->buffer);
-	free(ctx->image);
+	free(ctx->column_sums);
+	free(ctx->block_sums);
+	free(ctx->copy_sums);
+	free(ctx->planes);
+	free(ctx->spare_frame);
+	if (ctx->image != ctx->image_scaled) free(ctx->image);
 	free(ctx->image_scaled);
 }
 
-int _b2v_fill_image_next(uint8_t *image, int bits_per_pixel,
-	int start, int end, uint8_t *buffer, size_t bytes, int *tbit, int *tbyte,
-	int *buffer_idx, bool isg_mode)
+// The frame that goes to ffmpeg while encoding
+static uint8_t *b2v_frame(struct b2v_context *ctx) {
+	return (ctx->format == B2V_FORMAT_RGB) ? ctx->image_scaled : ctx->planes;
+}
+
+static size_t b2v_frame_size(struct b2v_context *ctx) {
+	return (ctx->format == B2V_FORMAT_RGB) ? ctx->image_scaled_size :
+		ctx->planes_size;
+}
+
+// Switches to the other of two frame buffers, so the frame that was just
+// handed to the pipe stays untouched until the next frame is written.
+void b2v_next_frame(struct b2v_context *ctx) {
+	uint8_t *frame = b2v_frame(ctx);
+	size_t size = b2v_frame_size(ctx);
+	if (ctx->spare_frame == NULL) {
+		// Starts out with the region below the data
+		ctx->spare_frame = b2v_pipe_alloc(size);
+		memcpy(ctx->spare_frame, frame, size);
+	}
+	uint8_t *next = ctx->spare_frame;
+	ctx->spare_frame = frame;
+	if (ctx->format != B2V_FORMAT_RGB) {
+		ctx->planes = next;
+		return;
+	}
+	if (ctx->image == ctx->image_scaled) {
+		ctx->image = next;
+	}
+	ctx->image_scaled = next;
+}
+
+// Writes block row y into the planes. Component c of every block goes to
+// plane c, in YUV420 the chroma planes have half as many lines and columns.
+// The metadata frame only has luma, so it still reads as black and white
+// when the video is decoded as RGB.
+static void b2v_fill_planes(struct b2v_context *ctx, const uint8_t *row, int y)
 {
-	if (*tbyte == -1) {
-		*tbyte = 0;
-	}
-	int i;
-	for (i=start; (i < end) && (*tbyte != -1); i++) {
-		int value;
-		switch (bits_per_pixel) {
-			case 1:
-				value = get_bit(buffer, bytes, tbyte, tbit, buffer_idx, isg_mode) * 0xFF;
-				memset(image + (i * 3), value, 3);
-				break;
-			default:
-				for (int c=0; c<3; c++) {
-					value = 0;
-					for (int b=0; b<bits_per_comp[bits_per_pixel][c]; b++) {
-						value <<= 1;
-						value |= get_bit(buffer, bytes, tbyte, tbit, buffer_idx, isg_mode);
-					}
-					value = (uint8_t)round(comp_div[bits_per_pixel][c] * (double)value);
-					image[i * 3 + c] = value;
-				}
-				break;
+	int shift = (ctx->format == B2V_FORMAT_YUV420);
+	int width = ctx->width * ctx->scale;
+	int lines = ctx->height * ctx->scale + ctx->scaled_pad_height;
+	uint8_t *plane = ctx->planes;
+	for (int c=0; c<3; c++) {
+		int plane_shift = (c == 0) ? 0 : shift;
+		int scale = ctx->scale >> plane_shift;
+		int line_size = width >> plane_shift;
+		uint8_t *line = plane + (size_t)line_size * scale * y;
+		if ((c == 0) || (ctx->bits_per_pixel != 1)) {
+			for (int x=0; x<ctx->width; x++) {
+				memset(line + x * scale, row[x * 3 + c], scale);
+			}
+		}
+		else {
+			memset(line, 128, line_size);
+		}
+		for (int i=1; i<scale; i++) {
+			memcpy(line + line_size * i, line, line_size);
+		}
+		plane += (size_t)line_size * (lines >> plane_shift);
+	}
+}
+
+// Turns the sampled lines of block row y of the planes back into packed
+// lines in image_scaled, for b2v_decode_row(). In YUV420, every chroma
+// sample is repeated for the 2 by 2 pixels it covers.
+static void b2v_unpack_planes(struct b2v_context *ctx, int y) {
+	int shift = (ctx->format == B2V_FORMAT_YUV420);
+	int width = ctx->width * ctx->scale;
+	int lines = ctx->height * ctx->scale;
+	const uint8_t *luma = ctx->planes;
+	const uint8_t *cb = luma + (size_t)width * lines;
+	const uint8_t *cr = cb + (size_t)(width >> shift) * (lines >> shift);
+	for (int i=0; i<ctx->sample_size; i++) {
+		int line = ctx->sample_offset + i;
+		int src_line = y * ctx->scale + line;
+		const uint8_t *y_pt = luma + (size_t)width * src_line;
+		size_t chroma_offset = (size_t)(width >> shift) * (src_line >> shift);
+		const uint8_t *cb_pt = cb + chroma_offset;
+		const uint8_t *cr_pt = cr + chroma_offset;
+		uint8_t *dst = ctx->image_scaled + (size_t)width * 3 * line;
+		for (int x=0; x<width; x++) {
+			dst[x * 3] = y_pt[x];
+			dst[x * 3 + 1] = cb_pt[x >> shift];
+			dst[x * 3 + 2] = cr_pt[x >> shift];
 		}
 	}
-	return i;
 }
 
-int b2v_fill_image(struct b2v_context *ctx, bool isg_mode) {
-	int buffer_idx = 0;
+// Packs the frame one block row at a time and immediately writes the scaled
+// lines of that row, so the frame is only written once. Returns the number
+// of bytes of data consumed.
+int b2v_fill_image(struct b2v_context *ctx, const uint8_t *data, size_t size) {
 	int blocks = ctx->width * ctx->height;
 
 	uint8_t metadata[4];
 	int metadata_end;
-	if (isg_mode) {
+	if (ctx->isg_mode) {
 		metadata_end = 0;
 	}
 	else {
 		metadata_end = sizeof(metadata) * 8;
 	}
 	
-	int image_idx = _b2v_fill_image_next(ctx->image, ctx->bits_per_pixel,
-		metadata_end, blocks, ctx->buffer, ctx->bytes_available, &ctx->tbit,
-		&ctx->tbyte, &buffer_idx, isg_mode);
-	memset(ctx->image + image_idx * 3, 0, (blocks - image_idx) * 3);
-
-	int ret = buffer_idx;
-	if (!isg_mode) {
-		STORE_UINT32(metadata, image_idx);
-		int tbyte = 0, tbit = 0;
-		buffer_idx = 0;
-		image_idx = _b2v_fill_image_next(ctx->image, 1, 0, metadata_end, metadata,
-			sizeof(metadata), &tbit, &tbyte, &buffer_idx, isg_mode);
+	struct b2v_bit_reader reader, metadata_reader;
+	b2v_bit_reader_init(&reader, data, size, ctx->tbit, ctx->tbyte,
+		ctx->isg_mode);
+	if (!ctx->isg_mode) {
+		// The block count comes before the data, so work it out in advance. The
+		// block in which the data runs out is included, even if it is empty.
+		size_t bits = size * 8 + (ctx->tbit ? 8 - ctx->tbit : 0);
+		size_t data_blocks = bits / ctx->bits_per_pixel + 1;
+		if (data_blocks > (size_t)(blocks - metadata_end)) {
+			data_blocks = blocks - metadata_end;
+		}
+		STORE_UINT32(metadata, metadata_end + data_blocks);
+		b2v_bit_reader_init(&metadata_reader, metadata, sizeof(metadata), 0, 0,
+			false);
 	}
 
-	// Scale image up
+	int line_size = ctx->width * ctx->scale * ctx->channels;
 	for (int y=0; y<ctx->height; y++) {
-		uint8_t *scaled_line = &ctx->image_scaled[ctx->width * ctx->scale * 3 * y
-			* ctx->scale];
-		uint8_t *scaled_line_pt = scaled_line;
-		for (int x=0; x<ctx->width; x++) {
-			uint8_t *source_pixel = &ctx->image[(y * ctx->width + x) * 3];
-			for (int i=0; i<ctx->scale; i++) {
-				memcpy(scaled_line_pt, source_pixel, 3);
-				scaled_line_pt += 3;
+		uint8_t *scaled_line = ctx->image_scaled;
+		if (ctx->format == B2V_FORMAT_RGB) {
+			scaled_line += (size_t)line_size * y * ctx->scale;
+		}
+		uint8_t *row = (ctx->image == ctx->image_scaled) ? scaled_line :
+			ctx->image;
+		int row_start = y * ctx->width;
+		int i = 0;
+		if (row_start < metadata_end) {
+			int end = metadata_end - row_start;
+			if (end > ctx->width) {
+				end = ctx->width;
 			}
+			b2v_encode_fn encode_metadata = (ctx->channels == 1) ?
+				b2v_encode_gray_kernel(false) : b2v_encode_kernel(1, false);
+			i = encode_metadata(row, 0, end, &metadata_reader);
+		}
+		i = ctx->encode(row, i, ctx->width, &reader);
+		memset(row + i * ctx->channels, 0, (ctx->width - i) * ctx->channels);
+
+		if (ctx->format != B2V_FORMAT_RGB) {
+			b2v_fill_planes(ctx, row, y);
+			continue;
 		}
-		int diff = scaled_line_pt - scaled_line;
-		for (int i=1; i<ctx->scale; i++) {
-			memcpy(scaled_line + diff * i, scaled_line, diff);
+
+		// Scale row up
+		if (ctx->scale != 1) {
+			ctx->upscale(scaled_line, row, ctx->width, ctx->scale);
+			for (int line=1; line<ctx->scale; line++) {
+				memcpy(scaled_line + line_size * line, scaled_line, line_size);
+			}
 		}
 	}
 
-	return ret;
+	return b2v_bit_reader_finish(&reader, &ctx->tbit, &ctx->tbyte);
 }
 
-size_t b2v_fill_image_from_file(struct b2v_context *ctx, FILE *file, bool isg_mode) {
-	size_t bytes_read = fread(ctx->buffer + ctx->bytes_available, 1,
-		ctx->buffer_size - ctx->bytes_available, file);
-	ctx->bytes_available += bytes_read;
-	int next_idx = b2v_fill_image(ctx, isg_mode);
-	memmove(ctx->buffer, ctx->buffer + next_idx, ctx->bytes_available - next_idx);
-	ctx->bytes_available -= next_idx;
-	return bytes_read;
+// Adds up the columns of the lines into column_sums, then adds the sampled
+// columns of every block to its sums. At most 256 lines fit in a column sum.
+static void b2v_sum_lines(struct b2v_context *ctx, const uint8_t *lines,
+	int count)
+{
+	int line_size = ctx->width * ctx->scale * ctx->channels;
+	uint16_t *column_sums = ctx->column_sums;
+	for (int j=0; j<line_size; j++) {
+		column_sums[j] = lines[j];
+	}
+	for (int line=1; line<count; line++) {
+		const uint8_t *pt = lines + line_size * line;
+		for (int j=0; j<line_size; j++) {
+			column_sums[j] += pt[j];
+		}
+	}
+	if (ctx->channels == 1) {
+		column_sums += ctx->sample_offset;
+		for (int x=0; x<ctx->width; x++) {
+			uint32_t sum = 0;
+			for (int i=0; i<ctx->sample_size; i++) {
+				sum += column_sums[i];
+			}
+			ctx->block_sums[x] += sum;
+			column_sums += ctx->scale;
+		}
+		return;
+	}
+	column_sums += ctx->sample_offset * 3;
+	for (int x=0; x<ctx->width; x++) {
+		uint32_t r = 0, g = 0, b = 0;
+		for (int i=0; i<ctx->sample_size; i++) {
+			r += column_sums[i * 3];
+			g += column_sums[i * 3 + 1];
+			b += column_sums[i * 3 + 2];
+		}
+		ctx->block_sums[x * 3] += r;
+		ctx->block_sums[x * 3 + 1] += g;
+		ctx->block_sums[x * 3 + 2] += b;
+		column_sums += ctx->scale * 3;
+	}
 }
 
-void _b2v_decode_image_next(uint8_t *image, int bits_per_pixel,
-	int start, int end, uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx,
-	bool isg_mode)
+// Box filter over the sampled pixels of every block in a block row. Every
+// sampled line of the row is read once, in order.
+static void b2v_downscale_row(struct b2v_context *ctx, const uint8_t *lines,
+	uint8_t *row)
 {
-	for (int i=start; i<end; i++) {
-		switch (bits_per_pixel) {
-			int value;
-			case 1:
-				value = ((int)image[i * 3] + (int)image[i * 3 + 1]
-					+ (int)image[i * 3 + 2]) / 3;
-				value = (value > 127) ? 1 : 0;
-				put_bit(buffer, value, tbyte, tbit, buffer_idx, isg_mode);
-				break;
-			default:
-				for (int j=0; j<3; j++) {
-					double color = (double)image[i * 3 + j];
-					value = (int)round(color / comp_div[bits_per_pixel][j]);
-					for (int b=bits_per_comp[bits_per_pixel][j]-1; b>=0; b--) {
-						put_bit(buffer, ((uint8_t)value >> b) & 1, tbyte, tbit,
-							buffer_idx, isg_mode);
-					}
-				}
-				break;
+	int channels = ctx->channels;
+	int line_size = ctx->width * ctx->scale * channels;
+	int row_size = ctx->width * channels;
+	lines += (size_t)line_size * ctx->sample_offset;
+	if (ctx->sample_size == 1) {
+		// Centre pixel only
+		const uint8_t *pt = lines + ctx->sample_offset * channels;
+		for (int x=0; x<ctx->width; x++) {
+			memcpy(row + x * channels, pt, channels);
+			pt += ctx->scale * channels;
+		}
+		return;
+	}
+	memset(ctx->block_sums, 0, row_size * sizeof(*ctx->block_sums));
+	for (int line=0; line<ctx->sample_size; line+=256) {
+		int count = ctx->sample_size - line;
+		if (count > 256) {
+			count = 256;
+		}
+		b2v_sum_lines(ctx, lines + (size_t)line_size * line, count);
+	}
+	// sum * reciprocal >> 48 is exact while 255 * area^2 < 2^48
+	if (ctx->sample_size <= 1024) {
+		for (int j=0; j<row_size; j++) {
+			row[j] = (uint8_t)((ctx->block_sums[j] * ctx->reciprocal) >> 48);
+		}
+	}
+	else {
+		uint32_t area = ctx->sample_size * ctx->sample_size;
+		for (int j=0; j<row_size; j++) {
+			row[j] = (uint8_t)(ctx->block_sums[j] / area);
 		}
 	}
 }
 
-int b2v_decode_image(struct b2v_context *ctx, bool isg_mode) {
-	// Scale image down
-	int scaled_width = ctx->width * ctx->scale;
-	for (int y=0; y<ctx->height; y++) {
-		for (int x=0; x<ctx->width; x++) {
-			for (int i=0; i<3; i++) {
-				uint32_t sum = 0;
-				for (int sy = y * ctx->scale; sy < (y + 1) * ctx->scale; sy++) {
-					for (int sx = x * ctx->scale; sx < (x + 1) * ctx->scale; sx++) {
-						sum += ctx->image_scaled[(sy * scaled_width + sx) * 3 + i];
-					}
-				}
-				ctx->image[(y * ctx->width + x) * 3 + i] = (uint8_t)(sum /
-					(ctx->scale * ctx->scale));
+// Starts decoding a frame into ctx->buffer
+void b2v_decode_start(struct b2v_context *ctx) {
+	ctx->buffer_idx = 0;
+	ctx->metadata_idx = 0;
+	ctx->metadata_tbit = 0;
+	ctx->metadata_tbyte = 0;
+	// Without metadata, every block holds data
+	ctx->block_count = ctx->isg_mode ? (ctx->width * ctx->height) : 0;
+}
+
+// Decodes block row y of the frame from its scaled lines. Rows have to be
+// decoded in order, the block count is only known once the metadata blocks
+// at the start of the frame are decoded. When copies of the frame are
+// combined, the blocks of every copy are added up and the average of all
+// copies is decoded along with the last one.
+void b2v_decode_row(struct b2v_context *ctx, const uint8_t *lines, int y) {
+	int metadata_end = ctx->isg_mode ? 0 : (int)sizeof(ctx->metadata) * 8;
+	int row_start = y * ctx->width;
+	bool last_copy = (ctx->copy == ctx->copies - 1);
+	if (last_copy && (row_start >= metadata_end) &&
+		(row_start >= ctx->block_count))
+	{
+		// Past the end of the data
+		return;
+	}
+
+	// Scale row down
+	const uint8_t *row = lines;
+	if (ctx->scale != 1) {
+		b2v_downscale_row(ctx, lines, ctx->image);
+		row = ctx->image;
+	}
+
+	if (ctx->copies > 1) {
+		int row_size = ctx->width * ctx->channels;
+		uint16_t *sums = ctx->copy_sums + (size_t)row_size * y;
+		if (ctx->copy == 0) {
+			for (int j=0; j<row_size; j++) {
+				sums[j] = row[j];
 			}
 		}
+		else {
+			for (int j=0; j<row_size; j++) {
+				sums[j] += row[j];
+			}
+		}
+		if (!last_copy) {
+			return;
+		}
+		for (int j=0; j<row_size; j++) {
+			ctx->image[j] = (uint8_t)((sums[j] + ctx->copies / 2) / ctx->copies);
+		}
+		row = ctx->image;
 	}
 
-	int tbit=0, tbyte=0, buffer_idx=0;
-	uint32_t block_count;
-	int metadata_end;
-	if (isg_mode) {
-		block_count = ctx->width * ctx->height;
-		metadata_end = 0;
+	int i = 0;
+	if (row_start < metadata_end) {
+		i = metadata_end - row_start;
+		if (i > ctx->width) {
+			i = ctx->width;
+		}
+		b2v_decode_fn decode_metadata = (ctx->channels == 1) ?
+			b2v_decode_gray_kernel(false) : b2v_decode_kernel(1, false);
+		decode_metadata(row, 0, i, ctx->metadata,
+			&ctx->metadata_tbit, &ctx->metadata_tbyte, &ctx->metadata_idx);
+		if (row_start + i == metadata_end) {
+			uint32_t block_count = LOAD_UINT32(ctx->metadata);
+			uint32_t max_blocks = ctx->width * ctx->height;
+			if (block_count > max_blocks) {
+				block_count = max_blocks;
+			}
+			ctx->block_count = block_count;
+		}
 	}
-	else {
-		uint8_t metadata[4];
-		metadata_end = sizeof(metadata) * 8;
-		_b2v_decode_image_next(ctx->image, 1, 0, metadata_end, metadata, &tbit, &tbyte,
-			&buffer_idx, false);
-		block_count = LOAD_UINT32(metadata);
+	int end = ctx->block_count - row_start;
+	if (end > ctx->width) {
+		end = ctx->width;
 	}
-	
-	buffer_idx = 0;
-	int max_blocks = ctx->width * ctx->height;
-	int blocks = block_count;
-	if (blocks > max_blocks) {
-		blocks = max_blocks;
+	if (end > i) {
+		ctx->decode(row, i, end, ctx->buffer, &ctx->tbit, &ctx->tbyte,
+			&ctx->buffer_idx);
 	}
-	_b2v_decode_image_next(ctx->image, ctx->bits_per_pixel, metadata_end, blocks,
-		ctx->buffer, &ctx->tbit, &ctx->tbyte, &buffer_idx, isg_mode);
+}
 
-	return buffer_idx;
+int spawn(const char **argv, struct subprocess_s *proc) {
+	int options = subprocess_option_no_window | subprocess_option_inherit_environment |
+		subprocess_option_search_user_path;
+	return subprocess_create((const char * const *)argv, options, proc);
 }
 
-void write_get_bit(FILE *file, int value, int *tbyte, int *tbit) {
-	*tbyte |= value << *tbit;
-	*tbit += 1;
-	if (*tbit == 8) {
-		fputc(*tbyte, file);
-		*tbit = 0;
-		*tbyte = 0;
+// Name of the pixel format frames go through the pipe in
+static const char *b2v_pix_fmt(const struct b2v_context *ctx) {
+	switch (ctx->format) {
+		case B2V_FORMAT_YUV444: return "yuv444p";
+		case B2V_FORMAT_YUV420: return "yuv420p";
+		default: return (ctx->channels == 1) ? "gray" : "rgb24";
 	}
 }
 
-int spawn(const char **argv, struct subprocess_s *proc, bool enable_async) {
-	int options = subprocess_option_no_window | subprocess_option_inherit_environment |
-		subprocess_option_search_user_path;
-	if (enable_async) {
-		options |= subprocess_option_enable_async;
+// Starts ffmpeg decoding the video into raw frames. With a crop_height
+// above 0, only the top crop_height lines of every frame are output. Frames
+// before first_frame are skipped, and after it only every frame_step-th
+// frame is output, so repeated frames never cross the pipe. With a
+// block_size above 1, frames are scaled down to one pixel per block, or to
+// 2 by 2 pixels in yuv420p. Frames are cropped and dropped before they are
+// converted to pix_fmt.
+int spawn_decoder(const char *input, int crop_height, int first_frame,
+	int frame_step, int block_size, const char *pix_fmt,
+	struct subprocess_s *proc)
+{
+	char filters[192];
+	int filters_len = 0;
+	if (crop_height > 0) {
+		filters_len += snprintf(filters + filters_len,
+			sizeof(filters) - filters_len, "crop=iw:%d:0:0,", crop_height);
 	}
-	return subprocess_create((const char * const *)argv, options, proc);
+	bool select = (first_frame > 0) || (frame_step > 1);
+	if (select) {
+		filters_len += snprintf(filters + filters_len,
+			sizeof(filters) - filters_len, "select=gte(n\\,%d)*not(mod(n\\,%d)),",
+			first_frame, frame_step);
+	}
+	if (block_size > 1) {
+		// swscale's area filter isn't an exact box filter. Averaging the blocks
+		// in planar RGB after the usual RGB conversion gives the same colors
+		// as b2v_downscale_row().
+		bool rgb = (strcmp(pix_fmt, "rgb24") == 0);
+		int step = block_size;
+		if (strcmp(pix_fmt, "yuv420p") == 0) {
+			// Keep a chroma sample for every block
+			step /= 2;
+		}
+		filters_len += snprintf(filters + filters_len,
+			sizeof(filters) - filters_len, "format=%s,%s"
+			"pixelize=w=%d:h=%d:m=avg,scale=iw/%d:ih/%d:flags=neighbor,",
+			pix_fmt, rgb ? "format=gbrp," : "", block_size, block_size, step,
+			step);
+	}
+	const char *argv[16] = { "ffmpeg", "-i", input, "-f", "rawvideo",
+		"-pix_fmt", pix_fmt, "-v", "quiet", "-hide_banner" };
+	int argc = 10;
+	if (filters_len != 0) {
+		// Drop the trailing comma
+		filters[filters_len - 1] = '\0';
+		argv[argc++] = "-vf";
+		argv[argc++] = filters;
+	}
+	if (select) {
+		// Don't let the dropped frames be filled in with duplicates
+		argv[argc++] = "-vsync";
+		argv[argc++] = "passthrough";
+	}
+	argv[argc++] = "-";
+	argv[argc] = NULL;
+	return spawn(argv, proc);
 }
 
 int video_resolution(const char *file, int *width_pt, int *height_pt) {
@@ -323,7 +648,7 @@ int video_resolution(const char *file, int *width_pt, int *height_pt) {
 		file, NULL };
 	
 	struct subprocess_s ffmpeg_process;
-	int subprocess_ret = spawn(argv, &ffmpeg_process, false);
+	int subprocess_ret = spawn(argv, &ffmpeg_process);
 	if ( subprocess_ret != 0 ) {
 		fprintf(stderr, "couldn't spawn ffprobe\n");
 		return -1;
@@ -361,7 +686,7 @@ int video_resolution(const char *file, int *width_pt, int *height_pt) {
 }
 
 int b2v_decode(const char *input, const char *output, int initial_block_size,
-	bool isg_mode)
+	int data_height, int sample, bool combine, bool ffmpeg_scale, bool isg_mode)
 {
 	FILE *output_file;
 	if (output == NULL) {
@@ -380,50 +705,120 @@ int b2v_decode(const char *input, const char *output, int initial_block_size,
 		fprintf(stderr, "failed to get video resolution\n");
 		return EXIT_FAILURE;
 	}
+	if (data_height >= real_height) {
+		data_height = -1;
+	}
+	else if (data_height > 0) {
+		if (data_height % initial_block_size != 0) {
+			fprintf(stderr, "error: data height must be divisible by the initial "
+				"block size\n");
+			fclose(output_file);
+			return EXIT_FAILURE;
+		}
+		// Everything below the data is cropped away by ffmpeg
+		real_height = data_height;
+	}
 	
-	const char *argv[] = { "ffmpeg", "-i", input, "-f", "rawvideo", "-pix_fmt",
-		"rgb24", "-v", "quiet", "-hide_banner", "-", NULL };
 	struct subprocess_s ffmpeg_process;
-	int subprocess_ret = spawn(argv, &ffmpeg_process, true);
+	int subprocess_ret = spawn_decoder(input, data_height, 0, 1, 1, "rgb24",
+		&ffmpeg_process);
 	if (subprocess_ret != 0) {
 		fprintf(stderr, "couldn't spawn ffmpeg\n");
 		fclose(output_file);
 		return EXIT_FAILURE;
 	}
 
+	struct b2v_pipe_reader reader;
+	b2v_pipe_reader_init(&reader, fileno(ffmpeg_process.stdout_file),
+		DECODE_PIPE_SIZE);
+
 	struct b2v_context ctx;
 	b2v_context_init(&ctx, real_width / initial_block_size,
-		real_height / initial_block_size, 1, initial_block_size, 0);
-	int blocks = ctx.width * ctx.height;
+		real_height / initial_block_size, 1, 3, B2V_FORMAT_RGB,
+		initial_block_size, 0, DECODE_BAND_SIZE, sample, isg_mode);
 
 	int frame = 0;
 	size_t bytes_written = 0;
 	int truncate_frame = -1;
 	int frame_write = 1;
+	int format = B2V_FORMAT_RGB;
+	int frame_step = 1; // frames of the video in every frame read
 	int truncate_bytes = -1;
 	int result = -1;
-	unsigned int read_idx = 0;
+	// Frames are read one band of block rows at a time. Every block row is
+	// decoded as soon as all of its lines have been read.
+	size_t read_idx = 0; // bytes of the band read so far
+	int band_start = 0; // first block row of the band
+	int row = 0; // next block row to decode
+	bool decoding = false; // false for frames that are thrown away
 	while (result == -1) {
-		int is_alive = subprocess_alive(&ffmpeg_process);
-		unsigned int target_read = (blocks * ctx.scale * ctx.scale * 3);
-		unsigned int new_read = subprocess_read_stdout(&ffmpeg_process,
-			(char *)ctx.image_scaled + read_idx, target_read - read_idx);
-		if (new_read == 0) {
-			if (!is_alive) {
-				result = EXIT_SUCCESS;
-				break;
+		if ((band_start == 0) && (read_idx == 0)) {
+			// Repeated frames are only decoded when they are combined. In
+			// Infinite-Storage-Glitch mode, frames after the last one are never
+			// decoded.
+			ctx.copy = frame % ctx.copies;
+			decoding = ((frame % frame_write == 0) ||
+				((ctx.copies > 1) && (frame >= frame_write))) &&
+				((truncate_frame == -1) || (frame < truncate_frame));
+			if (decoding) {
+				b2v_decode_start(&ctx);
 			}
 		}
+		size_t row_size = (size_t)ctx.width * ctx.scale * ctx.scale *
+			ctx.channels;
+		int band_rows = ctx.height - band_start;
+		if (band_rows > ctx.band_rows) {
+			band_rows = ctx.band_rows;
+		}
+		uint8_t *band = ctx.image_scaled;
+		size_t band_end = row_size * band_rows;
+		if (ctx.format != B2V_FORMAT_RGB) {
+			// The chroma planes come after the luma, so planar frames are read
+			// whole before any row is decoded
+			band = ctx.planes;
+			band_rows = ctx.height;
+			band_end = ctx.planes_size;
+		}
+		size_t new_read = b2v_pipe_read(&reader, band + read_idx,
+			band_end - read_idx);
+		if (new_read == 0) {
+			// ffmpeg is done
+			result = reader.error ? EXIT_FAILURE : EXIT_SUCCESS;
+			break;
+		}
 		read_idx += new_read;
-		if (read_idx != target_read) {
+		if (ctx.format != B2V_FORMAT_RGB) {
+			while (decoding && (read_idx == band_end) && (row < ctx.height)) {
+				b2v_unpack_planes(&ctx, row);
+				b2v_decode_row(&ctx, ctx.image_scaled, row);
+				row++;
+			}
+		}
+		else {
+			while (decoding && ((row - band_start + 1) * row_size <= read_idx)) {
+				b2v_decode_row(&ctx, ctx.image_scaled + (row - band_start) * row_size,
+					row);
+				row++;
+			}
+		}
+		if (read_idx != band_end) {
 			continue;
 		}
-		if (frame++ % frame_write != 0) {
-			// Repeated frame
-			read_idx = 0;
+		read_idx = 0;
+		band_start += band_rows;
+		if (band_start != ctx.height) {
+			continue;
+		}
+
+		// The whole frame has been read
+		band_start = 0;
+		row = 0;
+		if (!decoding || (ctx.copy != ctx.copies - 1)) {
+			frame++;
 			continue;
 		}
-		int ret = b2v_decode_image(&ctx, isg_mode);
+		int ret = ctx.buffer_idx;
+		frame += frame_step;
 		if (frame == 1) {
 			// Metadata
 			if (isg_mode) {
@@ -447,7 +842,9 @@ int b2v_decode(const char *input, const char *output, int initial_block_size,
 			else {
 				// bin2video metadata
 				uint8_t metadata_version = ctx.buffer[0];
-				if ((metadata_version == 0) || (metadata_version > METADATA_VERSION)) {
+				if ((metadata_version == 0) ||
+					(metadata_version > METADATA_VERSION_FORMAT))
+				{
 					fprintf(stderr, "warning: unsupported metadata version (%d)\n",
 						metadata_version);
 				}
@@ -460,6 +857,9 @@ int b2v_decode(const char *input, const char *output, int initial_block_size,
 				if (metadata_version >= 2) {
 					frame_write = (int)ctx.buffer[4];
 				}
+				if (metadata_version >= METADATA_VERSION_FORMAT) {
+					format = (int)ctx.buffer[5];
+				}
 			}
 			if (ctx.scale <= 0 || real_width % ctx.scale != 0 ||
 				real_height % ctx.scale != 0)
@@ -476,29 +876,62 @@ int b2v_decode(const char *input, const char *output, int initial_block_size,
 				fprintf(stderr, "error: invalid frame repeat: %d", frame_write);
 				goto fail;
 			}
+			else if ((format < B2V_FORMAT_RGB) || (format > B2V_FORMAT_YUV420) ||
+				((format == B2V_FORMAT_YUV420) && (ctx.scale % 2 != 0)))
+			{
+				fprintf(stderr, "error: invalid pixel format: %d", format);
+				goto fail;
+			}
 			ctx.width = real_width / ctx.scale;
 			ctx.height = real_height / ctx.scale;
+			if (combine) {
+				ctx.copies = frame_write;
+			}
+			int block_size = ctx.scale;
+			if (ffmpeg_scale) {
+				// Frames arrive with one pixel per block, or 2 by 2 in YUV420
+				ctx.scale = (format == B2V_FORMAT_YUV420) ? 2 : 1;
+			}
+			// Black and white frames only need the luma
+			if ((ctx.bits_per_pixel == 1) && (format == B2V_FORMAT_RGB)) {
+				ctx.channels = 1;
+			}
+			ctx.format = format;
 			b2v_context_realloc(&ctx);
-			blocks = ctx.width * ctx.height;
+			if (((frame_write > 1) && !combine) || ffmpeg_scale ||
+				(ctx.channels == 1) || (format != B2V_FORMAT_RGB))
+			{
+				// Start over with ffmpeg only giving us the frames we need
+				int step = combine ? 1 : frame_write;
+				subprocess_terminate(&ffmpeg_process);
+				subprocess_join(&ffmpeg_process, NULL);
+				subprocess_destroy(&ffmpeg_process);
+				if (spawn_decoder(input, data_height, frame_write, step,
+					ffmpeg_scale ? block_size : 1, b2v_pix_fmt(&ctx),
+					&ffmpeg_process) != 0)
+				{
+					fprintf(stderr, "error: couldn't respawn ffmpeg\n");
+					// Leave nothing for the cleanup below
+					memset(&ffmpeg_process, 0, sizeof(ffmpeg_process));
+					goto fail;
+				}
+				b2v_pipe_reader_init(&reader, fileno(ffmpeg_process.stdout_file),
+					DECODE_PIPE_SIZE);
+				frame = frame_write;
+				frame_step = step;
+			}
 		}
 		else {
 			// File data
-			if (truncate_frame != -1) {
+			if ((frame == truncate_frame) && (truncate_bytes < ret)) {
 				// Trim null bytes in Infinite-Storage-Glitch mode
-				if ((frame == truncate_frame) && (truncate_bytes < ret)) {
-					ret = truncate_bytes;
-				}
-				else if (frame > truncate_frame) {
-					read_idx = 0;
-					continue;
-				}
+				ret = truncate_bytes;
 			}
 			bytes_written += ret;
 			fprintf(stderr, "\r%.1lf KiB written, %d frames",
 				((double)bytes_written / 1024), frame);
 			fwrite(ctx.buffer, 1, ret, output_file);
 		}
-		read_idx = 0;
 		continue;
 	fail:
 		result = EXIT_FAILURE;
@@ -509,6 +942,21 @@ int b2v_decode(const char *input, const char *output, int initial_block_size,
 	b2v_context_destroy(&ctx);
 	fclose(output_file);
 	
+	if (ffmpeg_process.stdout_file != NULL) {
+		if (result != EXIT_SUCCESS) {
+			// ffmpeg could be blocked on frames that will never be read
+			subprocess_terminate(&ffmpeg_process);
+		}
+		int exit_code;
+		if (subprocess_join(&ffmpeg_process, &exit_code) != 0) {
+			exit_code = -1;
+		}
+		if ((result == EXIT_SUCCESS) && (exit_code != 0)) {
+			// Every frame ffmpeg gave us was decoded, but it may have stopped early
+			fprintf(stderr, "error: ffmpeg exited with code %d\n", exit_code);
+			result = EXIT_FAILURE;
+		}
+	}
 	subprocess_destroy(&ffmpeg_process);
 	if (result == 0) {
 		return EXIT_SUCCESS;
@@ -521,40 +969,66 @@ int b2v_decode(const char *input, const char *output, int initial_block_size,
 int b2v_encode(const char *input, const char *output, int real_width,
 	int real_height, int initial_block_size, int block_size, int bits_per_pixel,
 	int framerate, const char **encode_argv, bool isg_mode, int data_height,
-	int frame_write, bool black_frame)
+	int frame_write, bool black_frame, bool ffmpeg_scale, int format)
 {
 	int encode_argc = 0;
 	for (const char **pt = encode_argv; *pt != NULL; pt++) {
 		encode_argc++;
 	}
-	FILE *input_file;
-	if (input == NULL) {
-		input_file = stdin;
+	struct b2v_input input_file;
+	if (b2v_input_open(&input_file, input) != 0) {
+		perror("couldn't open input for reading");
+		return EXIT_FAILURE;
 	}
-	else {
-		input_file = fopen(input, "rb");
-		if (input_file == NULL) {
-			perror("couldn't open input for reading");
-			return EXIT_FAILURE;
-		}
+
+	// Black and white frames are sent to ffmpeg with one byte per pixel, which
+	// is already just the luma
+	bool gray = (bits_per_pixel == 1);
+	if (gray) {
+		format = B2V_FORMAT_RGB;
 	}
+	// In YUV420, blocks need an even size to have chroma samples of their own
+	int chroma_step = (format == B2V_FORMAT_YUV420) ? 2 : 1;
 
-	int pixels = real_width * real_height;
-	int pad_height = real_width - data_height;
+	// With ffmpeg_scale, frames are sent to ffmpeg scaled down by the largest
+	// size both block sizes are a multiple of, and without the padding.
+	// ffmpeg scales them back up and adds the padding.
+	int ffmpeg_factor = 1;
+	if (ffmpeg_scale) {
+		for (int i=initial_block_size; i>1; i--) {
+			if ((initial_block_size % (i * chroma_step) == 0) &&
+				(block_size % (i * chroma_step) == 0))
+			{
+				ffmpeg_factor = i;
+				break;
+			}
+		}
+	}
+	int frame_width = real_width / ffmpeg_factor;
+	int frame_height = ffmpeg_scale ? (data_height / ffmpeg_factor) : real_height;
+	int pixels = frame_width * frame_height;
+	int pad_height = frame_height - data_height / ffmpeg_factor;
 	
 	struct b2v_context ctx;
 	b2v_context_init(&ctx, real_width / initial_block_size,
-		data_height / initial_block_size, 1, initial_block_size, pad_height);
+		data_height / initial_block_size, 1, gray ? 1 : 3, format,
+		initial_block_size / ffmpeg_factor, pad_height, 0, B2V_SAMPLE_AVERAGE,
+		isg_mode);
+	size_t frame_size = (size_t)pixels * ctx.channels;
+	if (format != B2V_FORMAT_RGB) {
+		frame_size = ctx.planes_size;
+	}
 
 	// Store metadata
+	size_t metadata_size;
 	if (isg_mode) {
-		int input_fd = fileno(input_file);
+		int input_fd = input_file.fd;
 		struct stat input_stat;
 		if (fstat(input_fd, &input_stat) != 0) {
 			perror("couldn't stat() input file");
 			fprintf(stderr, "only regular files can be encoded in Infinite-Storage-Glitch"
 				" mode\n");
-			fclose(input_file);
+			b2v_input_close(&input_file);
 			return EXIT_FAILURE;
 		}
 		off_t filesize = input_stat.st_size;
@@ -579,17 +1053,19 @@ int b2v_encode(const char *input, const char *output, int real_width,
 		STORE_UINT32(ctx.buffer + 8, final_block);
 		STORE_UINT32(ctx.buffer + 12, block_size);
 		STORE_UINT32(ctx.buffer + 16, 0xFFFFFFFF);
-		ctx.bytes_available = 20;
+		metadata_size = 20;
 	}
 	else {
-		ctx.buffer[0] = METADATA_VERSION;
+		ctx.buffer[0] = (format == B2V_FORMAT_RGB) ? METADATA_VERSION :
+			METADATA_VERSION_FORMAT;
 		ctx.buffer[1] = (uint8_t)block_size;
 		ctx.buffer[2] = (uint8_t)bits_per_pixel;
 		ctx.buffer[3] = ctx.buffer[0] + ctx.buffer[1] + ctx.buffer[2];
 		ctx.buffer[4] = (uint8_t)frame_write;
-		ctx.bytes_available = 5;
+		ctx.buffer[5] = (uint8_t)format;
+		metadata_size = (format == B2V_FORMAT_RGB) ? 5 : 6;
 	}
-	b2v_fill_image(&ctx, isg_mode);
+	b2v_fill_image(&ctx, ctx.buffer, metadata_size);
 
 	struct subprocess_s ffmpeg_process;
 	int subprocess_ret;
@@ -599,15 +1075,38 @@ int b2v_encode(const char *input, const char *output, int real_width,
 		framerate_str[sizeof(framerate_str)-1] = 0;
 
 		char video_resolution[33];
-		snprintf(video_resolution, sizeof(video_resolution), "%dx%d", real_width,
-			real_height);
+		snprintf(video_resolution, sizeof(video_resolution), "%dx%d", frame_width,
+			frame_height);
 		video_resolution[sizeof(video_resolution)-1] = 0;
 
+		// Nearest-neighbour scaling in planar RGB is exact, packed RGB would be
+		// scaled through YUV. Going back to packed RGB keeps the conversion to
+		// the output format the same as without ffmpeg_scale. Gray and YUV
+		// frames can be scaled as they are.
+		bool rgb = !gray && (format == B2V_FORMAT_RGB);
+		char filters[128];
+		int filters_len = 0;
+		if (ffmpeg_factor > 1) {
+			filters_len += snprintf(filters + filters_len,
+				sizeof(filters) - filters_len, "%s"
+				"scale=iw*%d:ih*%d:flags=neighbor,%s", rgb ? "format=gbrp," : "",
+				ffmpeg_factor, ffmpeg_factor, rgb ? "format=rgb24," : "");
+		}
+		if (data_height != real_height) {
+			filters_len += snprintf(filters + filters_len,
+				sizeof(filters) - filters_len, "pad=iw:%d:0:0:black,", real_height);
+		}
+		if (filters_len != 0) {
+			// Drop the trailing comma
+			filters[filters_len - 1] = '\0';
+		}
+
 		// 1) prepares argv = argv_start + encode_argv + argv_end 
 		// 2) spawns ffmpeg with argv
 		{
 			const char *_argv_start[] = { "ffmpeg", "-framerate", framerate_str, "-s",
-				video_resolution, "-f", "rawvideo", "-pix_fmt", "rgb24", "-i", "-" };
+				video_resolution, "-f", "rawvideo", "-pix_fmt", b2v_pix_fmt(&ctx),
+				"-i", "-" };
 			int argv_start_len = sizeof(_argv_start) / sizeof(*_argv_start);
 			const char **argv_start = _argv_start;
 			if (framerate == -1) {
@@ -617,61 +1116,93 @@ int b2v_encode(const char *input, const char *output, int real_width,
 			}
 			const char *argv_end[] = { "-movflags", "+faststart", "-hide_banner", "-y",
 				"-v", "quiet", "--", output, NULL };
-			const char **argv = malloc( (argv_start_len +
-				(sizeof(argv_end) / sizeof(*argv_end)) + encode_argc ) * sizeof(*argv) );
+			// Comes after encode_argv, which may add inputs of its own
+			const char *argv_filter[] = { "-vf", filters };
+			int argv_filter_len = (ffmpeg_scale && (filters_len != 0)) ? 2 : 0;
+			const char **argv = malloc( (argv_start_len + encode_argc +
+				argv_filter_len + (sizeof(argv_end) / sizeof(*argv_end))) *
+				sizeof(*argv) );
 			memcpy(argv, argv_start, argv_start_len * sizeof(*argv_start));
 			memcpy(argv + argv_start_len, encode_argv,
 				encode_argc * sizeof(*argv) );
-			memcpy(argv + argv_start_len + encode_argc, argv_end, sizeof(argv_end));
-			subprocess_ret = spawn(argv, &ffmpeg_process, false);
+			memcpy(argv + argv_start_len + encode_argc, argv_filter,
+				argv_filter_len * sizeof(*argv));
+			memcpy(argv + argv_start_len + encode_argc + argv_filter_len, argv_end,
+				sizeof(argv_end));
+			subprocess_ret = spawn(argv, &ffmpeg_process);
 			free(argv);
 		}
 
 		if ( subprocess_ret == -1 ) {
 			fprintf(stderr, "couldn't spawn ffmpeg\n");
-			fclose(input_file);
+			b2v_input_close(&input_file);
 			return EXIT_FAILURE;
 		}
 	}
 
-	for (int i=0; i<frame_write; i++) {
-		fwrite(ctx.image_scaled, pixels * 3, 1, ffmpeg_process.stdin_file);
-	}
+	struct b2v_pipe_writer writer;
+	b2v_pipe_writer_init(&writer, fileno(ffmpeg_process.stdin_file),
+		frame_size);
+	int write_ret = b2v_pipe_write(&writer, b2v_frame(&ctx), frame_size,
+		frame_write);
 
 	// Store file data
 	ctx.bits_per_pixel = bits_per_pixel;
-	ctx.scale = block_size;
+	ctx.scale = block_size / ffmpeg_factor;
 	ctx.width = real_width / block_size;
 	ctx.height = data_height / block_size;
 	b2v_context_realloc(&ctx);
 
-	size_t bytes_read = 0;
 	int frame = 0;
+	bool eof = false;
 
-	while ( !feof(input_file) ) {
-		bytes_read += b2v_fill_image_from_file(&ctx, input_file, isg_mode);
+	while (!eof && (write_ret == 0)) {
+		size_t size;
+		const uint8_t *data = b2v_input_peek(&input_file, ctx.buffer_size, &size,
+			&eof);
+		if (writer.splice) {
+			// The last frame may still be in the pipe
+			b2v_next_frame(&ctx);
+		}
+		b2v_input_consume(&input_file, b2v_fill_image(&ctx, data, size));
 		frame += frame_write;
-		fprintf(stderr, "\r%.1lf KiB written, %d frames",
-			((double)bytes_read / 1024), frame);
-		for (int i=0; i<frame_write; i++) {
-			fwrite(ctx.image_scaled, pixels * 3, 1, ffmpeg_process.stdin_file);
+		if (writer.blocked >= 0) {
+			fprintf(stderr, "\r%.1lf KiB written, %d frames, %.1lf s waiting for "
+				"ffmpeg", ((double)input_file.head / 1024), frame, writer.blocked);
+		}
+		else {
+			fprintf(stderr, "\r%.1lf KiB written, %d frames",
+				((double)input_file.head / 1024), frame);
 		}
+		write_ret = b2v_pipe_write(&writer, b2v_frame(&ctx), frame_size,
+			frame_write);
 	}
 
-	if (black_frame) {
-		memset(ctx.image_scaled, 0, pixels * 3);
-		for (int i=0; i<frame_write; i++) {
-			fwrite(ctx.image_scaled, pixels * 3, 1, ffmpeg_process.stdin_file);
+	if (black_frame && (write_ret == 0)) {
+		if (writer.splice) {
+			b2v_next_frame(&ctx);
+		}
+		if (format == B2V_FORMAT_RGB) {
+			memset(ctx.image_scaled, 0, frame_size);
 		}
+		else {
+			b2v_clear_planes(&ctx);
+		}
+		write_ret = b2v_pipe_write(&writer, b2v_frame(&ctx), frame_size,
+			frame_write);
 	}
 	fprintf(stderr, "\n");
 
-	fclose(input_file);
-	b2v_context_destroy(&ctx);
+	b2v_input_close(&input_file);
 
+	// Spliced frames may be read by ffmpeg until it exits
 	int exit_code;
 	subprocess_ret = subprocess_join(&ffmpeg_process, &exit_code);
 	subprocess_destroy(&ffmpeg_process);
+	b2v_context_destroy(&ctx);
+	if ((subprocess_ret == 0) && (exit_code == 0) && (write_ret != 0)) {
+		return EXIT_FAILURE;
+	}
 	if (subprocess_ret == 0) {
 		return exit_code;
 	}
@@ -3,11 +3,24 @@
 
 #include <stdbool.h>
 
+// How the decoder reads the color of a block. Values above 1 average the
+// inner n by n pixels of each block, which skips the edges where most
+// compression artifacts are.
+#define B2V_SAMPLE_AVERAGE 0 // average of every pixel
+#define B2V_SAMPLE_CENTER 1 // centre pixel only
+
+// How frames are laid out when they go through the pipe. In the YUV formats,
+// the three components of a block are written straight into the Y, U and V
+// planes instead of being converted from RGB.
+#define B2V_FORMAT_RGB 0 // packed RGB24, or grayscale at 1 bit per pixel
+#define B2V_FORMAT_YUV444 1 // planar YUV
+#define B2V_FORMAT_YUV420 2 // planar YUV, chroma at half width and height
+
 int b2v_encode(const char *input, const char *output, int real_width,
 	int real_height, int initial_block_size, int block_size, int bits_per_pixel,
 	int framerate, const char **encode_argv, bool isg_mode, int data_height,
-	int frame_write, bool black_frame);
+	int frame_write, bool black_frame, bool ffmpeg_scale, int format);
 int b2v_decode(const char *input, const char *output, int initial_block_size,
-	bool isg_mode);
+	int data_height, int sample, bool combine, bool ffmpeg_scale, bool isg_mode);
 
 #endif
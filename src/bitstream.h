@@ -0,0 +1,227 @@
+#ifndef B2V_BITSTREAM_H
+#define B2V_BITSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOAD_UINT64_LE(u8_pt) \
+	(uint64_t)( \
+		(uint64_t)(u8_pt)[0] | ((uint64_t)(u8_pt)[1] << 8) | \
+		((uint64_t)(u8_pt)[2] << 16) | ((uint64_t)(u8_pt)[3] << 24) | \
+		((uint64_t)(u8_pt)[4] << 32) | ((uint64_t)(u8_pt)[5] << 40) | \
+		((uint64_t)(u8_pt)[6] << 48) | ((uint64_t)(u8_pt)[7] << 56) \
+	)
+#define LOAD_UINT64_BE(u8_pt) \
+	(uint64_t)( \
+		((uint64_t)(u8_pt)[0] << 56) | ((uint64_t)(u8_pt)[1] << 48) | \
+		((uint64_t)(u8_pt)[2] << 40) | ((uint64_t)(u8_pt)[3] << 32) | \
+		((uint64_t)(u8_pt)[4] << 24) | ((uint64_t)(u8_pt)[5] << 16) | \
+		((uint64_t)(u8_pt)[6] << 8) | (uint64_t)(u8_pt)[7] \
+	)
+
+// reverse_bits[byte] = byte with its bits in the opposite order
+extern uint8_t b2v_reverse_bits[256];
+
+// Reads the input one 64-bit word at a time. In normal mode, bits are taken
+// starting from the least significant bit of each byte and the next bit is
+// kept at bit 0 of `bits`. In Infinite-Storage-Glitch mode (rev), bits are
+// taken starting from the most significant bit and the next bit is kept at
+// bit 63. Bits above `count` (below for rev) are either zero or a copy of
+// the bytes at `pt`, so refilling over them is harmless.
+//
+// The functions that take a `rev` argument expect it to match reader->rev,
+// it is passed separately so kernels can make it a constant.
+struct b2v_bit_reader {
+	uint64_t bits;
+	int count;
+	const uint8_t *start;
+	const uint8_t *pt;
+	const uint8_t *end;
+	bool rev;
+	bool eof;
+};
+
+static inline void b2v_bit_reader_init(struct b2v_bit_reader *reader,
+	const uint8_t *buffer, size_t size, int tbit, int tbyte, bool rev)
+{
+	reader->start = buffer;
+	reader->pt = buffer;
+	reader->end = buffer + size;
+	reader->rev = rev;
+	reader->eof = false;
+	reader->bits = 0;
+	reader->count = 0;
+	if (tbit != 0) {
+		// Left over bits from the previous frame
+		reader->count = 8 - tbit;
+		if (rev) reader->bits = (uint64_t)((tbyte << tbit) & 0xFF) << 56;
+		else     reader->bits = (uint64_t)((tbyte & 0xFF) >> tbit);
+	}
+}
+
+static inline void b2v_bit_reader_refill(struct b2v_bit_reader *reader,
+	bool rev)
+{
+	if (reader->end - reader->pt >= 8) {
+		if (rev) reader->bits |= LOAD_UINT64_BE(reader->pt) >> reader->count;
+		else     reader->bits |= LOAD_UINT64_LE(reader->pt) << reader->count;
+		reader->pt += (63 - reader->count) >> 3;
+		reader->count |= 56;
+	}
+	else {
+		while ((reader->count <= 56) && (reader->pt != reader->end)) {
+			if (rev) reader->bits |= (uint64_t)*reader->pt << (56 - reader->count);
+			else     reader->bits |= (uint64_t)*reader->pt << reader->count;
+			reader->pt++;
+			reader->count += 8;
+		}
+	}
+}
+
+// Returns the next `n` (1 to 24) bits, with the first bit read as the most
+// significant bit. Reading past the end of the buffer yields zeros and sets
+// `eof`.
+static inline int b2v_bit_reader_read(struct b2v_bit_reader *reader, int n,
+	bool rev)
+{
+	if (reader->count < n) {
+		b2v_bit_reader_refill(reader, rev);
+		if (reader->count < n) {
+			reader->eof = true;
+			reader->count = n;
+		}
+	}
+	int value;
+	if (rev) {
+		value = (int)(reader->bits >> (64 - n));
+		reader->bits <<= n;
+	}
+	else {
+		// Bits were read LSB-first, reverse them
+		uint32_t field = (uint32_t)reader->bits & ((1U << n) - 1);
+		if (n <= 8) {
+			value = b2v_reverse_bits[field] >> (8 - n);
+		}
+		else {
+			value = (b2v_reverse_bits[field & 0xFF] << 16) |
+				(b2v_reverse_bits[(field >> 8) & 0xFF] << 8) |
+				b2v_reverse_bits[(field >> 16) & 0xFF];
+			value >>= 24 - n;
+		}
+		reader->bits >>= n;
+	}
+	reader->count -= n;
+	return value;
+}
+
+// Hands out up to `max` whole bytes straight from the buffer, so they can be
+// processed in bulk. The number of bytes is rounded down to a multiple of
+// `unit`. The reader must be byte aligned.
+static inline size_t b2v_bit_reader_take(struct b2v_bit_reader *reader,
+	size_t max, size_t unit, const uint8_t **bytes)
+{
+	// Give back the whole bytes that are still buffered
+	reader->pt -= reader->count >> 3;
+	reader->count = 0;
+	reader->bits = 0;
+
+	size_t available = reader->end - reader->pt;
+	if (max > available) {
+		max = available;
+	}
+	max -= max % unit;
+	*bytes = reader->pt;
+	reader->pt += max;
+	return max;
+}
+
+// Returns the number of bytes consumed from the buffer. A partially consumed
+// byte counts as consumed, its remaining bits are stored in tbit and tbyte.
+static inline int b2v_bit_reader_finish(struct b2v_bit_reader *reader,
+	int *tbit, int *tbyte)
+{
+	if (reader->eof) {
+		*tbit = 0;
+		*tbyte = 0;
+		return reader->end - reader->start;
+	}
+	int partial = reader->count & 7;
+	int consumed = (reader->pt - reader->start) - (reader->count >> 3);
+	if (partial == 0) {
+		*tbit = 0;
+		*tbyte = 0;
+	}
+	else {
+		*tbit = 8 - partial;
+		if (reader->rev) *tbyte = (int)(reader->bits >> (64 - partial));
+		else             *tbyte = (int)((reader->bits & ((1U << partial) - 1)) << *tbit);
+	}
+	return consumed;
+}
+
+// Writes the output 32 bits at a time, the counterpart of b2v_bit_reader.
+// In normal mode, values are given with their first bit at bit 0 and bits
+// are stored starting from the least significant bit of each byte. In
+// Infinite-Storage-Glitch mode (rev), values are given with their first bit
+// as the most significant bit and bits are stored starting from the most
+// significant bit of each byte. Pending bits are kept at the bottom of
+// `bits` (top for rev).
+struct b2v_bit_writer {
+	uint64_t bits;
+	int count;
+	uint8_t *pt;
+};
+
+// Continues after the partial byte in tbit and tbyte.
+static inline void b2v_bit_writer_init(struct b2v_bit_writer *writer,
+	uint8_t *buffer, int tbit, int tbyte, bool rev)
+{
+	writer->pt = buffer;
+	writer->count = tbit;
+	if (rev) writer->bits = (uint64_t)(tbyte & 0xFF) << 56;
+	else     writer->bits = (uint64_t)(tbyte & 0xFF);
+}
+
+// Writes the next `n` (1 to 24) bits
+static inline void b2v_bit_writer_put(struct b2v_bit_writer *writer,
+	uint32_t value, int n, bool rev)
+{
+	if (rev) writer->bits |= (uint64_t)value << (64 - writer->count - n);
+	else     writer->bits |= (uint64_t)value << writer->count;
+	writer->count += n;
+	if (writer->count >= 32) {
+		for (int i=0; i<4; i++) {
+			if (rev) writer->pt[i] = (uint8_t)(writer->bits >> (56 - i * 8));
+			else     writer->pt[i] = (uint8_t)(writer->bits >> (i * 8));
+		}
+		if (rev) writer->bits <<= 32;
+		else     writer->bits >>= 32;
+		writer->pt += 4;
+		writer->count -= 32;
+	}
+}
+
+// Writes out the pending whole bytes. Afterwards writer->pt is where the
+// next whole byte goes, and the remaining bits are stored in tbit and tbyte
+// the same way b2v_bit_writer_init() expects them.
+static inline void b2v_bit_writer_flush(struct b2v_bit_writer *writer,
+	int *tbit, int *tbyte, bool rev)
+{
+	while (writer->count >= 8) {
+		if (rev) {
+			*(writer->pt++) = (uint8_t)(writer->bits >> 56);
+			writer->bits <<= 8;
+		}
+		else {
+			*(writer->pt++) = (uint8_t)writer->bits;
+			writer->bits >>= 8;
+		}
+		writer->count -= 8;
+	}
+	*tbit = writer->count;
+	if (rev) *tbyte = (int)(writer->bits >> 56);
+	else     *tbyte = (int)(writer->bits & 0xFF);
+}
+
+#endif
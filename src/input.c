@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+#include "input.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// The ring holds at least this many bytes, or 4 windows if that is more
+#define RING_MIN_SIZE (4 << 20)
+
+int b2v_input_open(struct b2v_input *input, const char *path) {
+	memset(input, 0, sizeof(*input));
+	if (path == NULL) {
+		input->fd = STDIN_FILENO;
+	}
+	else {
+		input->fd = open(path, O_RDONLY | O_BINARY);
+		if (input->fd == -1) {
+			return -1;
+		}
+		input->close_fd = true;
+	}
+#if !defined(_WIN32)
+	struct stat input_stat;
+	if ((fstat(input->fd, &input_stat) == 0) && S_ISREG(input_stat.st_mode) &&
+		(input_stat.st_size > 0) && ((uint64_t)input_stat.st_size <= SIZE_MAX))
+	{
+		void *mapping = mmap(NULL, input_stat.st_size, PROT_READ, MAP_PRIVATE,
+			input->fd, 0);
+		if (mapping != MAP_FAILED) {
+			madvise(mapping, input_stat.st_size, MADV_SEQUENTIAL);
+			input->mapping = mapping;
+			input->size = input_stat.st_size;
+		}
+	}
+#endif
+	return 0;
+}
+
+static void ring_fill(struct b2v_input *input, size_t want) {
+	if (input->ring == NULL) {
+		input->window = want;
+		input->ring_size = RING_MIN_SIZE;
+		while (input->ring_size < want * 4) {
+			input->ring_size *= 2;
+		}
+		input->ring = malloc(input->ring_size + want);
+	}
+	size_t mask = input->ring_size - 1;
+	while (!input->eof && (input->head - input->tail < want)) {
+		size_t pos = input->head & mask;
+		size_t free_bytes = input->ring_size - (input->head - input->tail);
+		size_t count = input->ring_size - pos;
+		if (count > free_bytes) {
+			count = free_bytes;
+		}
+		ssize_t bytes_read = read(input->fd, input->ring + pos, count);
+		if ((bytes_read == -1) && (errno == EINTR)) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			if (bytes_read == -1) {
+				perror("couldn't read input");
+			}
+			input->eof = true;
+			break;
+		}
+		if (pos < input->window) {
+			// Keep the mirror after the ring up to date
+			size_t end = pos + bytes_read;
+			if (end > input->window) {
+				end = input->window;
+			}
+			memcpy(input->ring + input->ring_size + pos, input->ring + pos,
+				end - pos);
+		}
+		input->head += bytes_read;
+	}
+}
+
+const uint8_t *b2v_input_peek(struct b2v_input *input, size_t want,
+	size_t *size, bool *eof)
+{
+	if (input->mapping != NULL) {
+		// Same as reading `want` bytes with fread()
+		input->eof = (input->size - input->tail < want);
+		input->head = input->eof ? input->size : (input->tail + want);
+		*size = input->head - input->tail;
+		*eof = input->eof;
+		return input->mapping + input->tail;
+	}
+	ring_fill(input, want);
+	*size = input->head - input->tail;
+	if (*size > want) {
+		*size = want;
+	}
+	*eof = input->eof;
+	return input->ring + (input->tail & (input->ring_size - 1));
+}
+
+void b2v_input_consume(struct b2v_input *input, size_t bytes) {
+	input->tail += bytes;
+}
+
+void b2v_input_close(struct b2v_input *input) {
+#if !defined(_WIN32)
+	if (input->mapping != NULL) {
+		munmap((void *)input->mapping, input->size);
+	}
+#endif
+	free(input->ring);
+	if (input->close_fd) {
+		close(input->fd);
+	}
+}
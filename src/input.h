@@ -0,0 +1,39 @@
+#ifndef B2V_INPUT_H
+#define B2V_INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Input for the encoder. Regular files are mapped into memory and the frames
+// are packed straight from the mapping. Anything else is read into a ring
+// buffer with large read() calls. The ring is followed by a mirror of its
+// first `window` bytes, so the bytes handed out are always contiguous.
+struct b2v_input {
+	int fd;
+	bool close_fd;
+	bool eof;
+	uint64_t size; // size of the mapping
+	uint64_t head; // bytes read so far
+	uint64_t tail; // bytes consumed so far
+	const uint8_t *mapping;
+	uint8_t *ring;
+	size_t ring_size; // a power of two
+	size_t window;
+};
+
+// Opens path, or stdin if path is NULL. Returns 0 on success.
+int b2v_input_open(struct b2v_input *input, const char *path);
+
+// Returns up to `want` bytes of input, fewer only if the input ends before
+// that. eof is set if the input ended. Every call must ask for the same
+// number of bytes.
+const uint8_t *b2v_input_peek(struct b2v_input *input, size_t want,
+	size_t *size, bool *eof);
+
+// Drops `bytes` bytes from the start of the input.
+void b2v_input_consume(struct b2v_input *input, size_t bytes);
+
+void b2v_input_close(struct b2v_input *input);
+
+#endif
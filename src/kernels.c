@@ -0,0 +1,1673 @@
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include "kernels.h"
+
+#if B2V_X86
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#if B2V_NEON
+#include <arm_neon.h>
+#endif
+
+b2v_expand_1bpp_fn b2v_expand_1bpp = b2v_expand_1bpp_scalar;
+b2v_pack_1bpp_fn b2v_pack_1bpp = b2v_pack_1bpp_scalar;
+b2v_reverse_fn b2v_reverse_bytes = b2v_reverse_bytes_scalar;
+b2v_spread_fn b2v_spread_bits = b2v_spread_bits_scalar;
+b2v_gather_fn b2v_gather_bits = b2v_gather_bits_scalar;
+b2v_encode_gather_fn b2v_encode_gather = NULL;
+uint8_t b2v_reverse_bits[256];
+
+// Bits used by each component at a given bits-per-pixel
+#define COMP_BITS(bits_per_pixel, comp) \
+	((bits_per_pixel) / 3 + ((bits_per_pixel) % 3 > (comp)))
+
+// array[bits_in_comp][value]
+
+static uint8_t level_encode[9][256]; // level -> color
+static uint8_t level_decode[9][256]; // color -> level
+static uint8_t stream_encode[9][256]; // level with its bits reversed -> color
+static uint8_t stream_decode[9][256]; // color -> level with its bits reversed
+static uint8_t stream_level[5][16]; // level -> level with its bits reversed
+
+// Output byte p of a run of expanded pixels comes from bit p/3 of the input,
+// which lives in input byte p/24. expand_mask[rev][p] selects that bit.
+static uint8_t expand_mask[2][96];
+static uint8_t expand_index[96];
+
+// pack_shuffle[c][v] moves component c of 16 pixels out of the v-th 16 bytes
+// of those pixels, into bytes 0..15.
+static uint8_t pack_shuffle[3][3][16];
+
+// spread_mask[rev][p] selects the input bit for output byte p of
+// b2v_spread_bits, which lives in input byte p/8.
+static uint8_t spread_mask[2][32];
+static uint8_t spread_index[32];
+
+// reverse_nibble[n] = n with its 4 bits reversed
+static const uint8_t reverse_nibble[16] = {
+	0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+};
+
+// Every block size up to UPSCALE_MAX_PLAN has its own upscaling kernel.
+// Output lines repeat with a period of lcm(3 * scale, 16) bytes. Each 16
+// byte vector in that period is a shuffle of the 16 source bytes starting at
+// `offset`, relative to the first source pixel of the period.
+#define UPSCALE_MAX_PLAN 10
+#define UPSCALE_MAX_VECTORS 27
+
+struct upscale_plan {
+	int vectors;
+	int src_step; // source bytes per period
+	int src_reach; // source bytes that must be readable for a period
+	int offset[UPSCALE_MAX_VECTORS];
+	uint8_t shuffle[UPSCALE_MAX_VECTORS][16];
+};
+
+static struct upscale_plan upscale_plans[UPSCALE_MAX_PLAN + 1];
+static b2v_upscale_fn upscale_kernels[UPSCALE_MAX_PLAN + 1];
+static b2v_upscale_fn upscale_generic;
+
+// Gather decoders are generated for every bits-per-pixel value from 2 to
+// 12, except for 3 which is decoded a byte at a time, so the component widths
+// are constants
+#define DECODE_GATHER_MAX 12
+#define DECODE_GATHER_KERNELS(kernel) \
+	kernel(2)  kernel(4)  kernel(5)  kernel(6)  kernel(7)  kernel(8) \
+	kernel(9)  kernel(10) kernel(11) kernel(12)
+#define DECODE_GATHER_SELECT(prefix) \
+	decode_gather_kernels[2] = prefix##_2; \
+	decode_gather_kernels[4] = prefix##_4; \
+	decode_gather_kernels[5] = prefix##_5; \
+	decode_gather_kernels[6] = prefix##_6; \
+	decode_gather_kernels[7] = prefix##_7; \
+	decode_gather_kernels[8] = prefix##_8; \
+	decode_gather_kernels[9] = prefix##_9; \
+	decode_gather_kernels[10] = prefix##_10; \
+	decode_gather_kernels[11] = prefix##_11; \
+	decode_gather_kernels[12] = prefix##_12;
+
+static b2v_decode_gather_fn decode_gather_kernels[DECODE_GATHER_MAX + 1];
+
+// Shuffles that turn an RGB pixel in bytes 0..2 into 48 bytes of repeated
+// RGB, 16 bytes at a time.
+static uint8_t upscale_pattern[48];
+
+// Groups of 8 blocks at bits-per-pixel values that don't line up with whole
+// bytes. Component c of a group is `width[c]` bits at bit `offset[c]` of the
+// group's bytes. The shuffle kernels gather 8 components at a time: lane j
+// of vector v holds the 2 bytes at shuffle[v][2*j] of the 16 bytes starting
+// at `window[v]`, and multiplying it by multiplier[v][j] moves the component
+// into the high byte.
+struct gather_plan {
+	int reach; // input bytes that must be readable for a group
+	int window[3];
+	uint8_t width[24];
+	uint8_t offset[24];
+	uint8_t mask[24];
+	uint8_t wide[24]; // 0xFF for components with bits_per_pixel / 3 + 1 bits
+	uint8_t shuffle[3][16];
+	uint16_t multiplier[3][8];
+	uint64_t deposit; // spreads 2 blocks over the low bits of 6 bytes
+	// Up to 2 bits per component, the level of a color is the number of
+	// thresholds it reaches. threshold[k][c] is the first color of level k + 1
+	// of component c.
+	uint8_t threshold[3][24];
+	uint8_t top[24]; // highest level of every component
+};
+
+static struct gather_plan gather_plans[24];
+
+void b2v_expand_1bpp_scalar(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	for (size_t i=0; i<bytes; i++) {
+		for (int b=0; b<8; b++) {
+			int bit = rev ? (7 - b) : b;
+			memset(image, ((input[i] >> bit) & 1) * 0xFF, 3);
+			image += 3;
+		}
+	}
+}
+
+// A pixel is white if (r + g + b) / 3 > 127
+#define PACK_THRESHOLD 383
+
+void b2v_pack_1bpp_scalar(uint8_t *output, const uint8_t *image, size_t bytes,
+	bool rev)
+{
+	for (size_t i=0; i<bytes; i++) {
+		int value = 0;
+		for (int b=0; b<8; b++) {
+			int bit = rev ? (7 - b) : b;
+			int sum = (int)image[0] + (int)image[1] + (int)image[2];
+			value |= (sum > PACK_THRESHOLD) << bit;
+			image += 3;
+		}
+		output[i] = value;
+	}
+}
+
+void b2v_reverse_bytes_scalar(uint8_t *dst, const uint8_t *src, size_t bytes) {
+	for (size_t i=0; i<bytes; i++) {
+		dst[i] = b2v_reverse_bits[src[i]];
+	}
+}
+
+void b2v_spread_bits_scalar(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	for (size_t i=0; i<bytes; i++) {
+		for (int b=0; b<8; b++) {
+			int bit = rev ? (7 - b) : b;
+			*(image++) = ((input[i] >> bit) & 1) * 0xFF;
+		}
+	}
+}
+
+void b2v_gather_bits_scalar(uint8_t *output, const uint8_t *image, size_t bytes,
+	bool rev)
+{
+	for (size_t i=0; i<bytes; i++) {
+		int value = 0;
+		for (int b=0; b<8; b++) {
+			int bit = rev ? (7 - b) : b;
+			value |= (*(image++) >> 7) << bit;
+		}
+		output[i] = value;
+	}
+}
+
+void b2v_encode_gather_scalar(uint8_t *image, const uint8_t *input,
+	size_t groups, int bits_per_pixel)
+{
+	const struct gather_plan *plan = &gather_plans[bits_per_pixel];
+	for (size_t g=0; g<groups; g++) {
+		for (int c=0; c<24; c++) {
+			int offset = plan->offset[c];
+			int field = input[offset / 8] >> (offset % 8);
+			if ((offset % 8) + plan->width[c] > 8) {
+				field |= input[offset / 8 + 1] << (8 - (offset % 8));
+			}
+			image[c] = stream_encode[plan->width[c]][field & plan->mask[c]];
+		}
+		input += bits_per_pixel;
+		image += 24;
+	}
+}
+
+void b2v_decode_gather_scalar(uint8_t *output, const uint8_t *image,
+	size_t groups, int bits_per_pixel)
+{
+	const struct gather_plan *plan = &gather_plans[bits_per_pixel];
+	for (size_t g=0; g<groups; g++) {
+		memset(output, 0, bits_per_pixel);
+		for (int c=0; c<24; c++) {
+			int offset = plan->offset[c];
+			int field = stream_decode[plan->width[c]][image[c]];
+			output[offset / 8] |= field << (offset % 8);
+			if ((offset % 8) + plan->width[c] > 8) {
+				output[offset / 8 + 1] |= field >> (8 - (offset % 8));
+			}
+		}
+		image += 24;
+		output += bits_per_pixel;
+	}
+}
+
+void b2v_upscale_scalar(uint8_t *dst, const uint8_t *src, int width, int scale)
+{
+	for (int x=0; x<width; x++) {
+		for (int i=0; i<scale; i++) {
+			memcpy(dst, src, 3);
+			dst += 3;
+		}
+		src += 3;
+	}
+}
+
+void b2v_upscale_gray(uint8_t *dst, const uint8_t *src, int width, int scale) {
+	for (int x=0; x<width; x++) {
+		memset(dst, src[x], scale);
+		dst += scale;
+	}
+}
+
+static void upscale_copy(uint8_t *dst, const uint8_t *src, int width, int scale) {
+	(void)scale;
+	memcpy(dst, src, width * 3);
+}
+
+#if B2V_X86
+
+__attribute__((target("sse2")))
+static void expand_1bpp_sse2(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	const __m128i m0 = _mm_loadu_si128((const __m128i *)(expand_mask[rev]));
+	const __m128i m1 = _mm_loadu_si128((const __m128i *)(expand_mask[rev] + 16));
+	const __m128i m2 = _mm_loadu_si128((const __m128i *)(expand_mask[rev] + 32));
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		// 2 input bytes become 48 output bytes
+		__m128i x = _mm_cvtsi32_si128(input[i] | (input[i+1] << 8));
+		x = _mm_unpacklo_epi8(x, x);
+		x = _mm_unpacklo_epi16(x, x);
+		__m128i v0 = _mm_shuffle_epi32(x, 0x00);
+		__m128i v1 = _mm_shuffle_epi32(x, 0x50);
+		__m128i v2 = _mm_shuffle_epi32(x, 0x55);
+		v0 = _mm_cmpeq_epi8(_mm_and_si128(v0, m0), m0);
+		v1 = _mm_cmpeq_epi8(_mm_and_si128(v1, m1), m1);
+		v2 = _mm_cmpeq_epi8(_mm_and_si128(v2, m2), m2);
+		_mm_storeu_si128((__m128i *)(image + i * 24), v0);
+		_mm_storeu_si128((__m128i *)(image + i * 24 + 16), v1);
+		_mm_storeu_si128((__m128i *)(image + i * 24 + 32), v2);
+	}
+	b2v_expand_1bpp_scalar(image + i * 24, input + i, bytes - i, rev);
+}
+
+__attribute__((target("avx2")))
+static void expand_1bpp_avx2(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	const __m256i c0 = _mm256_loadu_si256((const __m256i *)expand_index);
+	const __m256i c1 = _mm256_loadu_si256((const __m256i *)(expand_index + 32));
+	const __m256i c2 = _mm256_loadu_si256((const __m256i *)(expand_index + 64));
+	const __m256i m0 = _mm256_loadu_si256((const __m256i *)(expand_mask[rev]));
+	const __m256i m1 = _mm256_loadu_si256((const __m256i *)(expand_mask[rev] + 32));
+	const __m256i m2 = _mm256_loadu_si256((const __m256i *)(expand_mask[rev] + 64));
+	size_t i;
+	for (i=0; i+4 <= bytes; i+=4) {
+		// 4 input bytes, copied into both lanes, become 96 output bytes
+		uint32_t word;
+		memcpy(&word, input + i, sizeof(word));
+		__m256i x = _mm256_set1_epi32((int)word);
+		__m256i v0 = _mm256_shuffle_epi8(x, c0);
+		__m256i v1 = _mm256_shuffle_epi8(x, c1);
+		__m256i v2 = _mm256_shuffle_epi8(x, c2);
+		v0 = _mm256_cmpeq_epi8(_mm256_and_si256(v0, m0), m0);
+		v1 = _mm256_cmpeq_epi8(_mm256_and_si256(v1, m1), m1);
+		v2 = _mm256_cmpeq_epi8(_mm256_and_si256(v2, m2), m2);
+		_mm256_storeu_si256((__m256i *)(image + i * 24), v0);
+		_mm256_storeu_si256((__m256i *)(image + i * 24 + 32), v1);
+		_mm256_storeu_si256((__m256i *)(image + i * 24 + 64), v2);
+	}
+	b2v_expand_1bpp_scalar(image + i * 24, input + i, bytes - i, rev);
+}
+
+// Returns a mask with the sign bit set in each of the 16 bytes for which
+// the pixel is white
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i pack_compare_ssse3(__m128i v0, __m128i v1, __m128i v2,
+	__m128i shuffle[3][3])
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i threshold = _mm_set1_epi16(PACK_THRESHOLD);
+	__m128i lo = zero, hi = zero;
+	for (int c=0; c<3; c++) {
+		__m128i x = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(v0, shuffle[c][0]),
+			_mm_shuffle_epi8(v1, shuffle[c][1])),
+			_mm_shuffle_epi8(v2, shuffle[c][2]));
+		lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(x, zero));
+		hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(x, zero));
+	}
+	return _mm_packs_epi16(_mm_cmpgt_epi16(lo, threshold),
+		_mm_cmpgt_epi16(hi, threshold));
+}
+
+__attribute__((target("ssse3")))
+static void pack_1bpp_ssse3(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev)
+{
+	__m128i shuffle[3][3];
+	for (int c=0; c<3; c++) {
+		for (int v=0; v<3; v++) {
+			shuffle[c][v] = _mm_loadu_si128((const __m128i *)pack_shuffle[c][v]);
+		}
+	}
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		// 16 pixels become 2 output bytes
+		const uint8_t *pt = image + i * 24;
+		int bits = _mm_movemask_epi8(pack_compare_ssse3(
+			_mm_loadu_si128((const __m128i *)pt),
+			_mm_loadu_si128((const __m128i *)(pt + 16)),
+			_mm_loadu_si128((const __m128i *)(pt + 32)), shuffle));
+		if (rev) {
+			output[i] = b2v_reverse_bits[bits & 0xFF];
+			output[i+1] = b2v_reverse_bits[bits >> 8];
+		}
+		else {
+			output[i] = bits & 0xFF;
+			output[i+1] = bits >> 8;
+		}
+	}
+	b2v_pack_1bpp_scalar(output + i, image + i * 24, bytes - i, rev);
+}
+
+__attribute__((target("avx2")))
+static void pack_1bpp_avx2(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev)
+{
+	// Each lane works on its own 16 pixels, like pack_1bpp_ssse3
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i threshold = _mm256_set1_epi16(PACK_THRESHOLD);
+	__m256i shuffle[3][3];
+	for (int c=0; c<3; c++) {
+		for (int v=0; v<3; v++) {
+			shuffle[c][v] = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i *)pack_shuffle[c][v]));
+		}
+	}
+	size_t i;
+	for (i=0; i+4 <= bytes; i+=4) {
+		// 32 pixels become 4 output bytes
+		const uint8_t *pt = image + i * 24;
+		__m256i v[3];
+		for (int j=0; j<3; j++) {
+			v[j] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *)(pt + j * 16))),
+				_mm_loadu_si128((const __m128i *)(pt + 48 + j * 16)), 1);
+		}
+		__m256i lo = zero, hi = zero;
+		for (int c=0; c<3; c++) {
+			__m256i x = _mm256_or_si256(_mm256_or_si256(
+				_mm256_shuffle_epi8(v[0], shuffle[c][0]),
+				_mm256_shuffle_epi8(v[1], shuffle[c][1])),
+				_mm256_shuffle_epi8(v[2], shuffle[c][2]));
+			lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(x, zero));
+			hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(x, zero));
+		}
+		uint32_t bits = (uint32_t)_mm256_movemask_epi8(_mm256_packs_epi16(
+			_mm256_cmpgt_epi16(lo, threshold), _mm256_cmpgt_epi16(hi, threshold)));
+		for (int b=0; b<4; b++) {
+			output[i+b] = rev ? b2v_reverse_bits[(bits >> (b * 8)) & 0xFF] :
+				(bits >> (b * 8)) & 0xFF;
+		}
+	}
+	b2v_pack_1bpp_scalar(output + i, image + i * 24, bytes - i, rev);
+}
+
+__attribute__((target("ssse3")))
+static void reverse_bytes_ssse3(uint8_t *dst, const uint8_t *src, size_t bytes) {
+	const __m128i low = _mm_set1_epi8(0x0F);
+	const __m128i table = _mm_loadu_si128((const __m128i *)reverse_nibble);
+	const __m128i table_high = _mm_slli_epi16(table, 4);
+	size_t i;
+	for (i=0; i+16 <= bytes; i+=16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_shuffle_epi8(table_high, _mm_and_si128(x, low));
+		__m128i hi = _mm_shuffle_epi8(table,
+			_mm_and_si128(_mm_srli_epi16(x, 4), low));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(lo, hi));
+	}
+	b2v_reverse_bytes_scalar(dst + i, src + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static void reverse_bytes_avx2(uint8_t *dst, const uint8_t *src, size_t bytes) {
+	const __m256i low = _mm256_set1_epi8(0x0F);
+	const __m256i table = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)reverse_nibble));
+	const __m256i table_high = _mm256_slli_epi16(table, 4);
+	size_t i;
+	for (i=0; i+32 <= bytes; i+=32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i lo = _mm256_shuffle_epi8(table_high, _mm256_and_si256(x, low));
+		__m256i hi = _mm256_shuffle_epi8(table,
+			_mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(lo, hi));
+	}
+	b2v_reverse_bytes_scalar(dst + i, src + i, bytes - i);
+}
+
+__attribute__((target("sse2")))
+static void spread_bits_sse2(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	const __m128i mask = _mm_loadu_si128((const __m128i *)spread_mask[rev]);
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		// 2 input bytes become 16 output bytes
+		__m128i x = _mm_cvtsi32_si128(input[i] | (input[i+1] << 8));
+		x = _mm_unpacklo_epi8(x, x);
+		x = _mm_unpacklo_epi16(x, x);
+		x = _mm_unpacklo_epi32(x, x);
+		x = _mm_cmpeq_epi8(_mm_and_si128(x, mask), mask);
+		_mm_storeu_si128((__m128i *)(image + i * 8), x);
+	}
+	b2v_spread_bits_scalar(image + i * 8, input + i, bytes - i, rev);
+}
+
+__attribute__((target("avx2")))
+static void spread_bits_avx2(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	const __m256i index = _mm256_loadu_si256((const __m256i *)spread_index);
+	const __m256i mask = _mm256_loadu_si256((const __m256i *)spread_mask[rev]);
+	size_t i;
+	for (i=0; i+4 <= bytes; i+=4) {
+		// 4 input bytes become 32 output bytes
+		uint32_t word;
+		memcpy(&word, input + i, sizeof(word));
+		__m256i x = _mm256_shuffle_epi8(_mm256_set1_epi32((int)word), index);
+		x = _mm256_cmpeq_epi8(_mm256_and_si256(x, mask), mask);
+		_mm256_storeu_si256((__m256i *)(image + i * 8), x);
+	}
+	b2v_spread_bits_scalar(image + i * 8, input + i, bytes - i, rev);
+}
+
+__attribute__((target("sse2")))
+static void gather_bits_sse2(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev)
+{
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		// The sign bits of 16 bytes are exactly the bits of 2 output bytes
+		int bits = _mm_movemask_epi8(_mm_loadu_si128(
+			(const __m128i *)(image + i * 8)));
+		if (rev) {
+			output[i] = b2v_reverse_bits[bits & 0xFF];
+			output[i+1] = b2v_reverse_bits[bits >> 8];
+		}
+		else {
+			output[i] = bits & 0xFF;
+			output[i+1] = bits >> 8;
+		}
+	}
+	b2v_gather_bits_scalar(output + i, image + i * 8, bytes - i, rev);
+}
+
+__attribute__((target("avx2")))
+static void gather_bits_avx2(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev)
+{
+	size_t i;
+	for (i=0; i+4 <= bytes; i+=4) {
+		uint32_t bits = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256(
+			(const __m256i *)(image + i * 8)));
+		for (int b=0; b<4; b++) {
+			output[i+b] = rev ? b2v_reverse_bits[(bits >> (b * 8)) & 0xFF] :
+				(bits >> (b * 8)) & 0xFF;
+		}
+	}
+	b2v_gather_bits_scalar(output + i, image + i * 8, bytes - i, rev);
+}
+
+// Maps 24 components to colors. Up to 12 bits-per-pixel, every component
+// has at most 4 bits and the level tables fit in a shuffle.
+__attribute__((target("ssse3"), always_inline))
+static inline void encode_lookup_ssse3(uint8_t *image, __m128i a, __m128i b,
+	const struct gather_plan *plan, int bits_per_pixel)
+{
+	if (bits_per_pixel <= 12) {
+		const __m128i narrow = _mm_loadu_si128(
+			(const __m128i *)stream_encode[bits_per_pixel / 3]);
+		const __m128i wide = _mm_loadu_si128(
+			(const __m128i *)stream_encode[bits_per_pixel / 3 + 1]);
+		__m128i wa = _mm_loadu_si128((const __m128i *)plan->wide);
+		__m128i wb = _mm_loadl_epi64((const __m128i *)(plan->wide + 16));
+		a = _mm_or_si128(_mm_and_si128(wa, _mm_shuffle_epi8(wide, a)),
+			_mm_andnot_si128(wa, _mm_shuffle_epi8(narrow, a)));
+		b = _mm_or_si128(_mm_and_si128(wb, _mm_shuffle_epi8(wide, b)),
+			_mm_andnot_si128(wb, _mm_shuffle_epi8(narrow, b)));
+		_mm_storeu_si128((__m128i *)image, a);
+		_mm_storel_epi64((__m128i *)(image + 16), b);
+	}
+	else {
+		uint8_t fields[32];
+		_mm_storeu_si128((__m128i *)fields, a);
+		_mm_storeu_si128((__m128i *)(fields + 16), b);
+		for (int c=0; c<24; c++) {
+			image[c] = stream_encode[plan->width[c]][fields[c]];
+		}
+	}
+}
+
+__attribute__((target("ssse3")))
+static void encode_gather_ssse3(uint8_t *image, const uint8_t *input,
+	size_t groups, int bits_per_pixel)
+{
+	const struct gather_plan *plan = &gather_plans[bits_per_pixel];
+	__m128i shuffle[3], multiplier[3];
+	for (int v=0; v<3; v++) {
+		shuffle[v] = _mm_loadu_si128((const __m128i *)plan->shuffle[v]);
+		multiplier[v] = _mm_loadu_si128((const __m128i *)plan->multiplier[v]);
+	}
+	const __m128i ma = _mm_loadu_si128((const __m128i *)plan->mask);
+	const __m128i mb = _mm_loadl_epi64((const __m128i *)(plan->mask + 16));
+	size_t g;
+	for (g=0; (g < groups) && ((groups - g) * bits_per_pixel >= (size_t)plan->reach);
+		g++)
+	{
+		__m128i f[3];
+		for (int v=0; v<3; v++) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(input + plan->window[v]));
+			x = _mm_mullo_epi16(_mm_shuffle_epi8(x, shuffle[v]), multiplier[v]);
+			f[v] = _mm_srli_epi16(x, 8);
+		}
+		__m128i a = _mm_and_si128(_mm_packus_epi16(f[0], f[1]), ma);
+		__m128i b = _mm_and_si128(_mm_packus_epi16(f[2], f[2]), mb);
+		encode_lookup_ssse3(image, a, b, plan, bits_per_pixel);
+		input += bits_per_pixel;
+		image += 24;
+	}
+	b2v_encode_gather_scalar(image, input, groups - g, bits_per_pixel);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("bmi2,ssse3")))
+static void encode_gather_bmi2(uint8_t *image, const uint8_t *input,
+	size_t groups, int bits_per_pixel)
+{
+	const struct gather_plan *plan = &gather_plans[bits_per_pixel];
+	const size_t reach = (6 * bits_per_pixel) / 8 + 8;
+	size_t g;
+	for (g=0; (g < groups) && ((groups - g) * bits_per_pixel >= reach); g++) {
+		// Every 2 blocks are deposited into 6 bytes
+		uint64_t d[4];
+		for (int p=0; p<4; p++) {
+			int offset = p * 2 * bits_per_pixel;
+			uint64_t word;
+			memcpy(&word, input + offset / 8, sizeof(word));
+			d[p] = _pdep_u64(word >> (offset % 8), plan->deposit);
+		}
+		__m128i a = _mm_set_epi64x((long long)((d[1] >> 16) | (d[2] << 32)),
+			(long long)(d[0] | (d[1] << 48)));
+		__m128i b = _mm_cvtsi64_si128((long long)((d[2] >> 32) | (d[3] << 16)));
+		encode_lookup_ssse3(image, a, b, plan, bits_per_pixel);
+		input += bits_per_pixel;
+		image += 24;
+	}
+	b2v_encode_gather_scalar(image, input, groups - g, bits_per_pixel);
+}
+
+#endif
+
+// Unpacks groups of 8 blocks with up to 4 bits per component. Up to 2 bits,
+// the level of every color is the number of thresholds of its component that
+// it reaches. With more levels, it is cheaper to compute it as round(color *
+// levels / 255), which is what the level tables hold. A shuffle then reverses
+// its bits into stream order, and multiplies merge the components two at a
+// time until every 64-bit lane holds 8 of them.
+#define FIELD_BITS(bits_per_pixel, c) COMP_BITS(bits_per_pixel, (c) % 3)
+#define FIELD_PAIR(bits_per_pixel, c) \
+	1, 1 << FIELD_BITS(bits_per_pixel, c)
+#define FIELD_QUAD(bits_per_pixel, c) \
+	1, 1 << (FIELD_BITS(bits_per_pixel, c) + FIELD_BITS(bits_per_pixel, c + 1))
+// Position of component c in the group's bits, and the bits of the n
+// components from c on
+#define FIELD_OFFSET(bits_per_pixel, c) \
+	((c) / 3 * (bits_per_pixel) + \
+	(((c) % 3 > 0) ? COMP_BITS(bits_per_pixel, 0) : 0) + \
+	(((c) % 3 > 1) ? COMP_BITS(bits_per_pixel, 1) : 0))
+#define FIELD_RUN(bits_per_pixel, c, n) \
+	(FIELD_OFFSET(bits_per_pixel, (c) + (n)) - FIELD_OFFSET(bits_per_pixel, c))
+
+__attribute__((target("ssse3"), always_inline))
+static inline void decode_gather_ssse3(uint8_t *output, const uint8_t *image,
+	size_t groups, int bits_per_pixel)
+{
+	const struct gather_plan *plan = &gather_plans[bits_per_pixel];
+	const int steps = (1 << COMP_BITS(bits_per_pixel, 0)) - 1;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ta = _mm_loadu_si128((const __m128i *)plan->top);
+	const __m128i tb = _mm_loadl_epi64((const __m128i *)(plan->top + 16));
+	const __m128i narrow = _mm_loadu_si128(
+		(const __m128i *)stream_level[bits_per_pixel / 3]);
+	const __m128i wide = _mm_loadu_si128(
+		(const __m128i *)stream_level[(bits_per_pixel + 2) / 3]);
+	const __m128i wa = _mm_loadu_si128((const __m128i *)plan->wide);
+	const __m128i wb = _mm_loadl_epi64((const __m128i *)(plan->wide + 16));
+	const __m128i pa = _mm_setr_epi8(
+		FIELD_PAIR(bits_per_pixel, 0), FIELD_PAIR(bits_per_pixel, 2),
+		FIELD_PAIR(bits_per_pixel, 4), FIELD_PAIR(bits_per_pixel, 6),
+		FIELD_PAIR(bits_per_pixel, 8), FIELD_PAIR(bits_per_pixel, 10),
+		FIELD_PAIR(bits_per_pixel, 12), FIELD_PAIR(bits_per_pixel, 14));
+	const __m128i pb = _mm_setr_epi8(
+		FIELD_PAIR(bits_per_pixel, 16), FIELD_PAIR(bits_per_pixel, 18),
+		FIELD_PAIR(bits_per_pixel, 20), FIELD_PAIR(bits_per_pixel, 22),
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i qa = _mm_setr_epi16(
+		FIELD_QUAD(bits_per_pixel, 0), FIELD_QUAD(bits_per_pixel, 4),
+		FIELD_QUAD(bits_per_pixel, 8), FIELD_QUAD(bits_per_pixel, 12));
+	const __m128i qb = _mm_setr_epi16(
+		FIELD_QUAD(bits_per_pixel, 16), FIELD_QUAD(bits_per_pixel, 20),
+		0, 0, 0, 0);
+	const __m128i oa = _mm_setr_epi32(1 << FIELD_RUN(bits_per_pixel, 0, 4), 0,
+		1 << FIELD_RUN(bits_per_pixel, 8, 4), 0);
+	const __m128i ob = _mm_setr_epi32(1 << FIELD_RUN(bits_per_pixel, 16, 4), 0,
+		0, 0);
+	const __m128i low = _mm_setr_epi32(-1, 0, -1, 0);
+	// Bits in the first and second lane
+	const int run0 = FIELD_RUN(bits_per_pixel, 0, 8);
+	const int run1 = FIELD_RUN(bits_per_pixel, 8, 8);
+	for (size_t g=0; g<groups; g++) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)image);
+		const __m128i b = _mm_loadl_epi64((const __m128i *)(image + 16));
+		__m128i la, lb;
+		if (steps <= 3) {
+			la = zero;
+			lb = zero;
+			for (int k=0; k<steps; k++) {
+				__m128i ka = _mm_loadu_si128((const __m128i *)plan->threshold[k]);
+				__m128i kb = _mm_loadl_epi64(
+					(const __m128i *)(plan->threshold[k] + 16));
+				// 0xFF (-1) where the color reaches the threshold
+				la = _mm_sub_epi8(la, _mm_cmpeq_epi8(_mm_max_epu8(a, ka), a));
+				lb = _mm_sub_epi8(lb, _mm_cmpeq_epi8(_mm_max_epu8(b, kb), b));
+			}
+			la = _mm_min_epu8(la, ta);
+			lb = _mm_min_epu8(lb, tb);
+		}
+		else {
+			// (x * levels + 127) / 255, the division as a multiply by 0x8081
+			const __m128i half = _mm_set1_epi16(127);
+			const __m128i div = _mm_set1_epi16((short)0x8081);
+			__m128i x[3] = { _mm_unpacklo_epi8(a, zero),
+				_mm_unpackhi_epi8(a, zero), _mm_unpacklo_epi8(b, zero) };
+			__m128i levels[3] = { _mm_unpacklo_epi8(ta, zero),
+				_mm_unpackhi_epi8(ta, zero), _mm_unpacklo_epi8(tb, zero) };
+			for (int v=0; v<3; v++) {
+				x[v] = _mm_add_epi16(_mm_mullo_epi16(x[v], levels[v]), half);
+				x[v] = _mm_srli_epi16(_mm_mulhi_epu16(x[v], div), 7);
+			}
+			la = _mm_packus_epi16(x[0], x[1]);
+			lb = _mm_packus_epi16(x[2], x[2]);
+		}
+		la = _mm_or_si128(_mm_and_si128(wa, _mm_shuffle_epi8(wide, la)),
+			_mm_andnot_si128(wa, _mm_shuffle_epi8(narrow, la)));
+		lb = _mm_or_si128(_mm_and_si128(wb, _mm_shuffle_epi8(wide, lb)),
+			_mm_andnot_si128(wb, _mm_shuffle_epi8(narrow, lb)));
+		// 2, then 4, then 8 components per lane
+		la = _mm_madd_epi16(_mm_maddubs_epi16(la, pa), qa);
+		lb = _mm_madd_epi16(_mm_maddubs_epi16(lb, pb), qb);
+		la = _mm_add_epi64(_mm_and_si128(la, low),
+			_mm_mul_epu32(_mm_srli_epi64(la, 32), oa));
+		lb = _mm_add_epi64(_mm_and_si128(lb, low),
+			_mm_mul_epu32(_mm_srli_epi64(lb, 32), ob));
+		uint64_t lanes[3];
+		_mm_storeu_si128((__m128i *)lanes, la);
+		_mm_storel_epi64((__m128i *)(lanes + 2), lb);
+		uint64_t bits = lanes[0] | (lanes[1] << run0);
+		if (run0 + run1 < 64) {
+			bits |= lanes[2] << (run0 + run1);
+		}
+		for (int i=0; i<bits_per_pixel; i++) {
+			if (i == 8) {
+				bits = lanes[2] >> (64 - run0 - run1);
+			}
+			output[i] = (bits >> ((i % 8) * 8)) & 0xFF;
+		}
+		image += 24;
+		output += bits_per_pixel;
+	}
+}
+
+#define DECODE_GATHER_SSSE3(bits_per_pixel) \
+	__attribute__((target("ssse3"))) \
+	static void decode_gather_ssse3_##bits_per_pixel(uint8_t *output, \
+		const uint8_t *image, size_t groups, int unused) \
+	{ \
+		(void)unused; \
+		decode_gather_ssse3(output, image, groups, bits_per_pixel); \
+	}
+
+DECODE_GATHER_KERNELS(DECODE_GATHER_SSSE3)
+
+#define UPSCALE_SSSE3(scale) \
+	__attribute__((target("ssse3"))) \
+	static void upscale_ssse3_##scale(uint8_t *dst, const uint8_t *src, \
+		int width, int unused) \
+	{ \
+		(void)unused; \
+		upscale_ssse3(dst, src, width, scale); \
+	}
+
+__attribute__((target("ssse3"), always_inline))
+static inline void upscale_ssse3(uint8_t *dst, const uint8_t *src, int width,
+	int scale)
+{
+	const struct upscale_plan *plan = &upscale_plans[scale];
+	const uint8_t *src_end = src + width * 3;
+	while (src_end - src >= plan->src_reach) {
+		for (int v=0; v<plan->vectors; v++) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(src + plan->offset[v]));
+			x = _mm_shuffle_epi8(x,
+				_mm_loadu_si128((const __m128i *)plan->shuffle[v]));
+			_mm_storeu_si128((__m128i *)dst, x);
+			dst += 16;
+		}
+		src += plan->src_step;
+	}
+	b2v_upscale_scalar(dst, src, (src_end - src) / 3, scale);
+}
+
+UPSCALE_SSSE3(2)
+UPSCALE_SSSE3(3)
+UPSCALE_SSSE3(4)
+UPSCALE_SSSE3(5)
+UPSCALE_SSSE3(6)
+UPSCALE_SSSE3(7)
+UPSCALE_SSSE3(8)
+UPSCALE_SSSE3(9)
+UPSCALE_SSSE3(10)
+
+// Any block size. Each pixel is written as whole vectors of repeated RGB,
+// the excess is overwritten by the next pixel.
+__attribute__((target("ssse3")))
+static void upscale_generic_ssse3(uint8_t *dst, const uint8_t *src, int width,
+	int scale)
+{
+	const __m128i s0 = _mm_loadu_si128((const __m128i *)upscale_pattern);
+	const __m128i s1 = _mm_loadu_si128((const __m128i *)(upscale_pattern + 16));
+	const __m128i s2 = _mm_loadu_si128((const __m128i *)(upscale_pattern + 32));
+	int run = scale * 3;
+	for (int x=0; x<width-1; x++) {
+		__m128i pixel = _mm_cvtsi32_si128(src[0] | (src[1] << 8) | (src[2] << 16));
+		__m128i p0 = _mm_shuffle_epi8(pixel, s0);
+		__m128i p1 = _mm_shuffle_epi8(pixel, s1);
+		__m128i p2 = _mm_shuffle_epi8(pixel, s2);
+		int i = 0;
+		for (;;) {
+			_mm_storeu_si128((__m128i *)(dst + i), p0);
+			if ((i += 16) >= run) break;
+			_mm_storeu_si128((__m128i *)(dst + i), p1);
+			if ((i += 16) >= run) break;
+			_mm_storeu_si128((__m128i *)(dst + i), p2);
+			if ((i += 16) >= run) break;
+		}
+		dst += run;
+		src += 3;
+	}
+	if (width > 0) {
+		// Don't write past the end of the line
+		b2v_upscale_scalar(dst, src, 1, scale);
+	}
+}
+
+#endif
+
+#if B2V_NEON
+
+static void expand_1bpp_neon(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	const uint8x16_t c0 = vld1q_u8(expand_index);
+	const uint8x16_t c1 = vld1q_u8(expand_index + 16);
+	const uint8x16_t c2 = vld1q_u8(expand_index + 32);
+	const uint8x16_t m0 = vld1q_u8(expand_mask[rev]);
+	const uint8x16_t m1 = vld1q_u8(expand_mask[rev] + 16);
+	const uint8x16_t m2 = vld1q_u8(expand_mask[rev] + 32);
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		// 2 input bytes become 48 output bytes
+		uint8x16_t x = vreinterpretq_u8_u16(vdupq_n_u16(input[i] |
+			(input[i+1] << 8)));
+		vst1q_u8(image + i * 24, vtstq_u8(vqtbl1q_u8(x, c0), m0));
+		vst1q_u8(image + i * 24 + 16, vtstq_u8(vqtbl1q_u8(x, c1), m1));
+		vst1q_u8(image + i * 24 + 32, vtstq_u8(vqtbl1q_u8(x, c2), m2));
+	}
+	b2v_expand_1bpp_scalar(image + i * 24, input + i, bytes - i, rev);
+}
+
+static void pack_1bpp_neon(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev)
+{
+	const uint8x16_t weights = vld1q_u8(spread_mask[rev]);
+	const uint16x8_t threshold = vdupq_n_u16(PACK_THRESHOLD);
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		// 16 pixels become 2 output bytes
+		uint8x16x3_t rgb = vld3q_u8(image + i * 24);
+		uint16x8_t lo = vaddw_u8(vaddl_u8(vget_low_u8(rgb.val[0]),
+			vget_low_u8(rgb.val[1])), vget_low_u8(rgb.val[2]));
+		uint16x8_t hi = vaddw_u8(vaddl_u8(vget_high_u8(rgb.val[0]),
+			vget_high_u8(rgb.val[1])), vget_high_u8(rgb.val[2]));
+		uint8x16_t x = vcombine_u8(vmovn_u16(vcgtq_u16(lo, threshold)),
+			vmovn_u16(vcgtq_u16(hi, threshold)));
+		x = vandq_u8(x, weights);
+		output[i] = vaddv_u8(vget_low_u8(x));
+		output[i+1] = vaddv_u8(vget_high_u8(x));
+	}
+	b2v_pack_1bpp_scalar(output + i, image + i * 24, bytes - i, rev);
+}
+
+static void reverse_bytes_neon(uint8_t *dst, const uint8_t *src, size_t bytes) {
+	size_t i;
+	for (i=0; i+16 <= bytes; i+=16) {
+		vst1q_u8(dst + i, vrbitq_u8(vld1q_u8(src + i)));
+	}
+	b2v_reverse_bytes_scalar(dst + i, src + i, bytes - i);
+}
+
+static void spread_bits_neon(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev)
+{
+	const uint8x16_t index = vld1q_u8(spread_index);
+	const uint8x16_t mask = vld1q_u8(spread_mask[rev]);
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		uint8x16_t x = vreinterpretq_u8_u16(vdupq_n_u16(input[i] |
+			(input[i+1] << 8)));
+		vst1q_u8(image + i * 8, vtstq_u8(vqtbl1q_u8(x, index), mask));
+	}
+	b2v_spread_bits_scalar(image + i * 8, input + i, bytes - i, rev);
+}
+
+static void gather_bits_neon(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev)
+{
+	// Turns each byte into its bit if the sign bit is set, then adds up
+	// groups of 8 bytes
+	const uint8x16_t mask = vld1q_u8(spread_mask[rev]);
+	size_t i;
+	for (i=0; i+2 <= bytes; i+=2) {
+		uint8x16_t x = vld1q_u8(image + i * 8);
+		x = vandq_u8(vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(x), 7)),
+			mask);
+		output[i] = vaddv_u8(vget_low_u8(x));
+		output[i+1] = vaddv_u8(vget_high_u8(x));
+	}
+	b2v_gather_bits_scalar(output + i, image + i * 8, bytes - i, rev);
+}
+
+static void encode_gather_neon(uint8_t *image, const uint8_t *input,
+	size_t groups, int bits_per_pixel)
+{
+	const struct gather_plan *plan = &gather_plans[bits_per_pixel];
+	const uint8x16_t ma = vld1q_u8(plan->mask);
+	const uint8x8_t mb = vld1_u8(plan->mask + 16);
+	const uint8x16_t wa = vld1q_u8(plan->wide);
+	const uint8x8_t wb = vld1_u8(plan->wide + 16);
+	const uint8x16_t narrow = vld1q_u8(stream_encode[bits_per_pixel / 3]);
+	const uint8x16_t wide = vld1q_u8(stream_encode[bits_per_pixel / 3 + 1]);
+	size_t g;
+	for (g=0; (g < groups) && ((groups - g) * bits_per_pixel >= (size_t)plan->reach);
+		g++)
+	{
+		uint8x8_t f[3];
+		for (int v=0; v<3; v++) {
+			uint8x16_t x = vqtbl1q_u8(vld1q_u8(input + plan->window[v]),
+				vld1q_u8(plan->shuffle[v]));
+			f[v] = vshrn_n_u16(vmulq_u16(vreinterpretq_u16_u8(x),
+				vld1q_u16(plan->multiplier[v])), 8);
+		}
+		uint8x16_t a = vandq_u8(vcombine_u8(f[0], f[1]), ma);
+		uint8x8_t b = vand_u8(f[2], mb);
+		if (bits_per_pixel <= 12) {
+			// Every component has at most 4 bits
+			vst1q_u8(image, vbslq_u8(wa, vqtbl1q_u8(wide, a),
+				vqtbl1q_u8(narrow, a)));
+			vst1_u8(image + 16, vbsl_u8(wb, vqtbl1_u8(wide, b),
+				vqtbl1_u8(narrow, b)));
+		}
+		else {
+			uint8_t fields[24];
+			vst1q_u8(fields, a);
+			vst1_u8(fields + 16, b);
+			for (int c=0; c<24; c++) {
+				image[c] = stream_encode[plan->width[c]][fields[c]];
+			}
+		}
+		input += bits_per_pixel;
+		image += 24;
+	}
+	b2v_encode_gather_scalar(image, input, groups - g, bits_per_pixel);
+}
+
+#define UPSCALE_NEON(scale) \
+	static void upscale_neon_##scale(uint8_t *dst, const uint8_t *src, \
+		int width, int unused) \
+	{ \
+		(void)unused; \
+		upscale_neon(dst, src, width, scale); \
+	}
+
+__attribute__((always_inline))
+static inline void upscale_neon(uint8_t *dst, const uint8_t *src, int width,
+	int scale)
+{
+	const struct upscale_plan *plan = &upscale_plans[scale];
+	const uint8_t *src_end = src + width * 3;
+	while (src_end - src >= plan->src_reach) {
+		for (int v=0; v<plan->vectors; v++) {
+			vst1q_u8(dst, vqtbl1q_u8(vld1q_u8(src + plan->offset[v]),
+				vld1q_u8(plan->shuffle[v])));
+			dst += 16;
+		}
+		src += plan->src_step;
+	}
+	b2v_upscale_scalar(dst, src, (src_end - src) / 3, scale);
+}
+
+UPSCALE_NEON(2)
+UPSCALE_NEON(3)
+UPSCALE_NEON(4)
+UPSCALE_NEON(5)
+UPSCALE_NEON(6)
+UPSCALE_NEON(7)
+UPSCALE_NEON(8)
+UPSCALE_NEON(9)
+UPSCALE_NEON(10)
+
+static void upscale_generic_neon(uint8_t *dst, const uint8_t *src, int width,
+	int scale)
+{
+	const uint8x16_t s0 = vld1q_u8(upscale_pattern);
+	const uint8x16_t s1 = vld1q_u8(upscale_pattern + 16);
+	const uint8x16_t s2 = vld1q_u8(upscale_pattern + 32);
+	int run = scale * 3;
+	for (int x=0; x<width-1; x++) {
+		uint8x16_t pixel = vreinterpretq_u8_u32(vdupq_n_u32(src[0] | (src[1] << 8) |
+			(src[2] << 16)));
+		uint8x16_t p0 = vqtbl1q_u8(pixel, s0);
+		uint8x16_t p1 = vqtbl1q_u8(pixel, s1);
+		uint8x16_t p2 = vqtbl1q_u8(pixel, s2);
+		int i = 0;
+		for (;;) {
+			vst1q_u8(dst + i, p0);
+			if ((i += 16) >= run) break;
+			vst1q_u8(dst + i, p1);
+			if ((i += 16) >= run) break;
+			vst1q_u8(dst + i, p2);
+			if ((i += 16) >= run) break;
+		}
+		dst += run;
+		src += 3;
+	}
+	if (width > 0) {
+		// Don't write past the end of the line
+		b2v_upscale_scalar(dst, src, 1, scale);
+	}
+}
+
+#endif
+
+// Kernels for every bits-per-pixel and bit order are generated from these two
+// templates, so the component widths and level tables are constants. At 1
+// bits-per-pixel, there are also kernels for grayscale images (1 channel).
+
+// Blocks can be handled in bulk whenever the bits line up with whole bytes
+// again. Every BULK_BLOCKS blocks are stored in BULK_BYTES bytes.
+#define BULK_BLOCKS(bits_per_pixel) \
+	(((bits_per_pixel) == 24) ? 1 : 8)
+#define BULK_BYTES(bits_per_pixel) \
+	(((bits_per_pixel) == 24) ? 3 : (bits_per_pixel))
+
+__attribute__((always_inline))
+static inline int encode_blocks(uint8_t *image, int start, int end,
+	struct b2v_bit_reader *reader, const int bits_per_pixel, const int channels,
+	const bool rev)
+{
+	const int bits0 = COMP_BITS(bits_per_pixel, 0);
+	const int bits1 = COMP_BITS(bits_per_pixel, 1);
+	const int bits2 = COMP_BITS(bits_per_pixel, 2);
+	// Infinite-Storage-Glitch mode only uses 1 and 24 bits-per-pixel, the
+	// other values only have gather kernels for the normal bit order
+	const bool bulk = (bits_per_pixel == 1) || (bits_per_pixel == 3) ||
+		(bits_per_pixel == 24) || (!rev && (b2v_encode_gather != NULL));
+	const int bulk_blocks = BULK_BLOCKS(bits_per_pixel);
+	const int bulk_bytes = BULK_BYTES(bits_per_pixel);
+	int i;
+	for (i=start; (i < end) && !reader->eof; i++) {
+		int value = b2v_bit_reader_read(reader, bits_per_pixel, rev);
+		if (bits_per_pixel == 1) {
+			memset(image + (i * channels), value * 0xFF, channels);
+		}
+		else {
+			image[i * 3] = level_encode[bits0][value >> (bits1 + bits2)];
+			image[i * 3 + 1] = level_encode[bits1][(value >> bits2) &
+				((1 << bits1) - 1)];
+			image[i * 3 + 2] = level_encode[bits2][value & ((1 << bits2) - 1)];
+		}
+		if (bulk && ((reader->count & 7) == 0) && !reader->eof &&
+			(end - i > bulk_blocks))
+		{
+			// Byte aligned, convert whole bytes at once
+			const uint8_t *bytes;
+			size_t count = b2v_bit_reader_take(reader,
+				((end - i - 1) / bulk_blocks) * bulk_bytes, bulk_bytes, &bytes);
+			uint8_t *next = image + (i + 1) * channels;
+			if (bits_per_pixel == 1) {
+				if (channels == 1) b2v_spread_bits(next, bytes, count, rev);
+				else               b2v_expand_1bpp(next, bytes, count, rev);
+			}
+			else if (bits_per_pixel == 3) {
+				b2v_spread_bits(next, bytes, count, rev);
+			}
+			else if (bits_per_pixel != 24) {
+				b2v_encode_gather(next, bytes, count / bulk_bytes, bits_per_pixel);
+			}
+			else if (rev) {
+				memcpy(next, bytes, count);
+			}
+			else {
+				b2v_reverse_bytes(next, bytes, count);
+			}
+			i += (count / bulk_bytes) * bulk_blocks;
+		}
+	}
+	return i;
+}
+
+__attribute__((always_inline))
+static inline void decode_blocks(const uint8_t *image, int start, int end,
+	uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx,
+	const int bits_per_pixel, const int channels, const bool rev)
+{
+	const int bits0 = COMP_BITS(bits_per_pixel, 0);
+	const int bits1 = COMP_BITS(bits_per_pixel, 1);
+	const int bits2 = COMP_BITS(bits_per_pixel, 2);
+	const b2v_decode_gather_fn gather = rev ? NULL :
+		b2v_decode_gather_kernel(bits_per_pixel);
+	const bool bulk = (bits_per_pixel == 1) || (bits_per_pixel == 3) ||
+		(bits_per_pixel == 24) || (gather != NULL);
+	const int bulk_blocks = BULK_BLOCKS(bits_per_pixel);
+	const int bulk_bytes = BULK_BYTES(bits_per_pixel);
+	struct b2v_bit_writer writer;
+	b2v_bit_writer_init(&writer, buffer + *buffer_idx, *tbit, *tbyte, rev);
+	for (int i=start; i<end; i++) {
+		if (bulk && ((writer.count & 7) == 0) && (end - i >= bulk_blocks)) {
+			// Byte aligned, convert whole bytes at once
+			b2v_bit_writer_flush(&writer, tbit, tbyte, rev);
+			int count = ((end - i) / bulk_blocks) * bulk_bytes;
+			uint8_t *next = writer.pt;
+			if (bits_per_pixel == 1) {
+				if (channels == 1) b2v_gather_bits(next, image + i, count, rev);
+				else               b2v_pack_1bpp(next, image + i * 3, count, rev);
+			}
+			else if (bits_per_pixel == 3) {
+				b2v_gather_bits(next, image + i * 3, count, rev);
+			}
+			else if (bits_per_pixel != 24) {
+				gather(next, image + i * 3, count / bulk_bytes, bits_per_pixel);
+			}
+			else if (rev) {
+				memcpy(next, image + i * 3, count);
+			}
+			else {
+				b2v_reverse_bytes(next, image + i * 3, count);
+			}
+			writer.pt += count;
+			i += (count / bulk_bytes) * bulk_blocks;
+			if (i == end) {
+				break;
+			}
+		}
+		uint32_t value;
+		if ((bits_per_pixel == 1) && (channels == 1)) {
+			value = (image[i] > 127) ? 1 : 0;
+		}
+		else if (bits_per_pixel == 1) {
+			value = ((int)image[i * 3] + (int)image[i * 3 + 1]
+				+ (int)image[i * 3 + 2]) / 3;
+			value = (value > 127) ? 1 : 0;
+		}
+		else if (rev) {
+			value = (level_decode[bits0][image[i * 3]] << (bits1 + bits2)) |
+				(level_decode[bits1][image[i * 3 + 1]] << bits2) |
+				level_decode[bits2][image[i * 3 + 2]];
+		}
+		else {
+			// Levels with their bits in stream order, so the first component
+			// ends up at bit 0
+			value = stream_decode[bits0][image[i * 3]] |
+				(stream_decode[bits1][image[i * 3 + 1]] << bits0) |
+				(stream_decode[bits2][image[i * 3 + 2]] << (bits0 + bits1));
+		}
+		b2v_bit_writer_put(&writer, value, bits_per_pixel, rev);
+	}
+	b2v_bit_writer_flush(&writer, tbit, tbyte, rev);
+	*buffer_idx = writer.pt - buffer;
+}
+
+#define BPP_KERNELS(bits_per_pixel) \
+	static int encode_##bits_per_pixel(uint8_t *image, int start, int end, \
+		struct b2v_bit_reader *reader) \
+	{ \
+		return encode_blocks(image, start, end, reader, bits_per_pixel, 3, \
+			false); \
+	} \
+	static int encode_rev_##bits_per_pixel(uint8_t *image, int start, int end, \
+		struct b2v_bit_reader *reader) \
+	{ \
+		return encode_blocks(image, start, end, reader, bits_per_pixel, 3, \
+			true); \
+	} \
+	static void decode_##bits_per_pixel(const uint8_t *image, int start, \
+		int end, uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx) \
+	{ \
+		decode_blocks(image, start, end, buffer, tbit, tbyte, buffer_idx, \
+			bits_per_pixel, 3, false); \
+	} \
+	static void decode_rev_##bits_per_pixel(const uint8_t *image, int start, \
+		int end, uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx) \
+	{ \
+		decode_blocks(image, start, end, buffer, tbit, tbyte, buffer_idx, \
+			bits_per_pixel, 3, true); \
+	}
+
+BPP_KERNELS(1)  BPP_KERNELS(2)  BPP_KERNELS(3)  BPP_KERNELS(4)
+BPP_KERNELS(5)  BPP_KERNELS(6)  BPP_KERNELS(7)  BPP_KERNELS(8)
+BPP_KERNELS(9)  BPP_KERNELS(10) BPP_KERNELS(11) BPP_KERNELS(12)
+BPP_KERNELS(13) BPP_KERNELS(14) BPP_KERNELS(15) BPP_KERNELS(16)
+BPP_KERNELS(17) BPP_KERNELS(18) BPP_KERNELS(19) BPP_KERNELS(20)
+BPP_KERNELS(21) BPP_KERNELS(22) BPP_KERNELS(23) BPP_KERNELS(24)
+
+#define BPP_ENTRY(bits_per_pixel) { \
+		{ encode_##bits_per_pixel, encode_rev_##bits_per_pixel }, \
+		{ decode_##bits_per_pixel, decode_rev_##bits_per_pixel } \
+	}
+
+// array[bits_per_pixel]
+
+static const struct {
+	b2v_encode_fn encode[2];
+	b2v_decode_fn decode[2];
+} bpp_kernels[25] = {
+	{ { NULL, NULL }, { NULL, NULL } },
+	BPP_ENTRY(1),  BPP_ENTRY(2),  BPP_ENTRY(3),  BPP_ENTRY(4),
+	BPP_ENTRY(5),  BPP_ENTRY(6),  BPP_ENTRY(7),  BPP_ENTRY(8),
+	BPP_ENTRY(9),  BPP_ENTRY(10), BPP_ENTRY(11), BPP_ENTRY(12),
+	BPP_ENTRY(13), BPP_ENTRY(14), BPP_ENTRY(15), BPP_ENTRY(16),
+	BPP_ENTRY(17), BPP_ENTRY(18), BPP_ENTRY(19), BPP_ENTRY(20),
+	BPP_ENTRY(21), BPP_ENTRY(22), BPP_ENTRY(23), BPP_ENTRY(24)
+};
+
+b2v_encode_fn b2v_encode_kernel(int bits_per_pixel, bool rev) {
+	return bpp_kernels[bits_per_pixel].encode[rev];
+}
+
+b2v_decode_fn b2v_decode_kernel(int bits_per_pixel, bool rev) {
+	return bpp_kernels[bits_per_pixel].decode[rev];
+}
+
+static int encode_gray(uint8_t *image, int start, int end,
+	struct b2v_bit_reader *reader)
+{
+	return encode_blocks(image, start, end, reader, 1, 1, false);
+}
+
+static int encode_gray_rev(uint8_t *image, int start, int end,
+	struct b2v_bit_reader *reader)
+{
+	return encode_blocks(image, start, end, reader, 1, 1, true);
+}
+
+static void decode_gray(const uint8_t *image, int start, int end,
+	uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx)
+{
+	decode_blocks(image, start, end, buffer, tbit, tbyte, buffer_idx, 1, 1,
+		false);
+}
+
+static void decode_gray_rev(const uint8_t *image, int start, int end,
+	uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx)
+{
+	decode_blocks(image, start, end, buffer, tbit, tbyte, buffer_idx, 1, 1,
+		true);
+}
+
+b2v_encode_fn b2v_encode_gray_kernel(bool rev) {
+	return rev ? encode_gray_rev : encode_gray;
+}
+
+b2v_decode_fn b2v_decode_gray_kernel(bool rev) {
+	return rev ? decode_gray_rev : decode_gray;
+}
+
+static void upscale_plans_init(void) {
+	for (int scale=2; scale<=UPSCALE_MAX_PLAN; scale++) {
+		struct upscale_plan *plan = &upscale_plans[scale];
+		int run = scale * 3;
+		int period = run;
+		while (period % 16 != 0) {
+			period += run;
+		}
+		plan->vectors = period / 16;
+		plan->src_step = (period / run) * 3;
+		plan->src_reach = plan->src_step;
+		for (int v=0; v<plan->vectors; v++) {
+			int first = ((v * 16) / run) * 3;
+			plan->offset[v] = first;
+			for (int j=0; j<16; j++) {
+				int o = v * 16 + j;
+				plan->shuffle[v][j] = ((o / run) * 3 + (o % 3)) - first;
+			}
+			if (first + 16 > plan->src_reach) {
+				plan->src_reach = first + 16;
+			}
+		}
+	}
+	for (int i=0; i<48; i++) {
+		upscale_pattern[i] = i % 3;
+	}
+}
+
+static void gather_plans_init(void) {
+	for (int bits_per_pixel=2; bits_per_pixel<=23; bits_per_pixel++) {
+		struct gather_plan *plan = &gather_plans[bits_per_pixel];
+		for (int c=0; c<24; c++) {
+			int comp = c % 3;
+			int width = COMP_BITS(bits_per_pixel, comp);
+			int offset = (c / 3) * bits_per_pixel;
+			for (int prev=0; prev<comp; prev++) {
+				offset += COMP_BITS(bits_per_pixel, prev);
+			}
+			plan->width[c] = width;
+			plan->offset[c] = offset;
+			plan->mask[c] = (1 << width) - 1;
+			plan->wide[c] = (width > bits_per_pixel / 3) ? 0xFF : 0x00;
+			plan->top[c] = plan->mask[c];
+			for (int k=0; k<3; k++) {
+				plan->threshold[k][c] = 0xFF;
+			}
+			for (int i=255; (width <= 2) && (i >= 0); i--) {
+				int level = level_decode[width][i];
+				if (level > 0) {
+					plan->threshold[level - 1][c] = i;
+				}
+			}
+		}
+		plan->deposit = 0;
+		for (int c=0; c<6; c++) {
+			plan->deposit |= (uint64_t)plan->mask[c] << (c * 8);
+		}
+		plan->reach = 0;
+		for (int v=0; v<3; v++) {
+			int window = plan->offset[v * 8] / 8;
+			plan->window[v] = window;
+			for (int j=0; j<8; j++) {
+				int offset = plan->offset[v * 8 + j];
+				plan->shuffle[v][j * 2] = offset / 8 - window;
+				plan->shuffle[v][j * 2 + 1] = offset / 8 + 1 - window;
+				plan->multiplier[v][j] = 1 << (8 - (offset % 8));
+			}
+			if (window + 16 > plan->reach) {
+				plan->reach = window + 16;
+			}
+		}
+	}
+}
+
+b2v_upscale_fn b2v_upscale_kernel(int scale) {
+	if (scale == 1) {
+		return upscale_copy;
+	}
+	if ((scale <= UPSCALE_MAX_PLAN) && (upscale_kernels[scale] != NULL)) {
+		return upscale_kernels[scale];
+	}
+	return upscale_generic;
+}
+
+b2v_decode_gather_fn b2v_decode_gather_kernel(int bits_per_pixel) {
+	if ((bits_per_pixel < 2) || (bits_per_pixel > DECODE_GATHER_MAX)) {
+		return NULL;
+	}
+	return decode_gather_kernels[bits_per_pixel];
+}
+
+static void tables_init(void) {
+	for (int i=0; i<256; i++) {
+		b2v_reverse_bits[i] = 0;
+		for (int b=0; b<8; b++) {
+			b2v_reverse_bits[i] |= ((i >> b) & 1) << (7 - b);
+		}
+	}
+	for (int bits=1; bits<=8; bits++) {
+		// Same rounding as the original floating point quantization, so
+		// existing videos still decode
+		double div = 255.0 / (double)((1 << bits) - 1);
+		for (int i=0; i<(1 << bits); i++) {
+			level_encode[bits][i] = (uint8_t)round(div * (double)i);
+		}
+		for (int i=0; i<256; i++) {
+			level_decode[bits][i] = (uint8_t)round((double)i / div);
+		}
+		for (int i=0; i<(1 << bits); i++) {
+			stream_encode[bits][i] =
+				level_encode[bits][b2v_reverse_bits[i] >> (8 - bits)];
+		}
+		for (int i=0; i<256; i++) {
+			stream_decode[bits][i] =
+				b2v_reverse_bits[level_decode[bits][i]] >> (8 - bits);
+		}
+		for (int i=0; (bits <= 4) && (i < (1 << bits)); i++) {
+			stream_level[bits][i] = b2v_reverse_bits[i] >> (8 - bits);
+		}
+	}
+
+	for (int p=0; p<32; p++) {
+		spread_index[p] = p / 8;
+		spread_mask[0][p] = 1 << (p % 8);
+		spread_mask[1][p] = 1 << (7 - (p % 8));
+	}
+	for (int c=0; c<3; c++) {
+		memset(pack_shuffle[c], 0x80, sizeof(pack_shuffle[c]));
+		for (int p=0; p<16; p++) {
+			int q = p * 3 + c;
+			pack_shuffle[c][q / 16][p] = q % 16;
+		}
+	}
+	for (int p=0; p<96; p++) {
+		int bit = (p / 3) % 8;
+		expand_index[p] = p / 24;
+		expand_mask[0][p] = 1 << bit;
+		expand_mask[1][p] = 1 << (7 - bit);
+	}
+
+	upscale_plans_init();
+	gather_plans_init();
+}
+
+static void select_scalar(void) {
+	b2v_expand_1bpp = b2v_expand_1bpp_scalar;
+	b2v_pack_1bpp = b2v_pack_1bpp_scalar;
+	b2v_reverse_bytes = b2v_reverse_bytes_scalar;
+	b2v_spread_bits = b2v_spread_bits_scalar;
+	b2v_gather_bits = b2v_gather_bits_scalar;
+	b2v_encode_gather = NULL;
+	for (int bits_per_pixel=0; bits_per_pixel<=DECODE_GATHER_MAX;
+		bits_per_pixel++)
+	{
+		decode_gather_kernels[bits_per_pixel] = NULL;
+	}
+	upscale_generic = b2v_upscale_scalar;
+	for (int scale=0; scale<=UPSCALE_MAX_PLAN; scale++) {
+		upscale_kernels[scale] = NULL;
+	}
+}
+
+static bool supports_all(void) {
+	return true;
+}
+
+#if B2V_X86
+
+static bool supports_sse2(void) {
+	return __builtin_cpu_supports("sse2");
+}
+
+static void select_sse2(void) {
+	b2v_expand_1bpp = expand_1bpp_sse2;
+	b2v_spread_bits = spread_bits_sse2;
+	b2v_gather_bits = gather_bits_sse2;
+}
+
+static bool supports_ssse3(void) {
+	return __builtin_cpu_supports("ssse3");
+}
+
+static void select_ssse3(void) {
+	b2v_pack_1bpp = pack_1bpp_ssse3;
+	b2v_reverse_bytes = reverse_bytes_ssse3;
+	upscale_kernels[2] = upscale_ssse3_2;
+	upscale_kernels[3] = upscale_ssse3_3;
+	upscale_kernels[4] = upscale_ssse3_4;
+	upscale_kernels[5] = upscale_ssse3_5;
+	upscale_kernels[6] = upscale_ssse3_6;
+	upscale_kernels[7] = upscale_ssse3_7;
+	upscale_kernels[8] = upscale_ssse3_8;
+	upscale_kernels[9] = upscale_ssse3_9;
+	upscale_kernels[10] = upscale_ssse3_10;
+	upscale_generic = upscale_generic_ssse3;
+	b2v_encode_gather = encode_gather_ssse3;
+	DECODE_GATHER_SELECT(decode_gather_ssse3)
+}
+
+static bool supports_avx2(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+static void select_avx2(void) {
+	b2v_expand_1bpp = expand_1bpp_avx2;
+	b2v_pack_1bpp = pack_1bpp_avx2;
+	b2v_reverse_bytes = reverse_bytes_avx2;
+	b2v_spread_bits = spread_bits_avx2;
+	b2v_gather_bits = gather_bits_avx2;
+}
+
+#if defined(__x86_64__)
+
+static bool supports_bmi2(void) {
+	return __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("ssse3");
+}
+
+static void select_bmi2(void) {
+	b2v_encode_gather = encode_gather_bmi2;
+}
+
+// AMD CPUs before Zen 3 (family 19h) run PDEP in microcode, which makes the
+// bmi2 kernels much slower than the ssse3 ones they replace. Hygon CPUs are
+// Zen 1.
+static bool slow_bmi2(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	char vendor[12];
+	memcpy(vendor, &ebx, 4);
+	memcpy(vendor + 4, &edx, 4);
+	memcpy(vendor + 8, &ecx, 4);
+	if ((memcmp(vendor, "AuthenticAMD", 12) != 0) &&
+		(memcmp(vendor, "HygonGenuine", 12) != 0))
+	{
+		return false;
+	}
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	unsigned int family = (eax >> 8) & 0xF;
+	if (family == 0xF) {
+		family += (eax >> 20) & 0xFF;
+	}
+	return family < 0x19;
+}
+
+#endif
+
+#endif
+
+#if B2V_NEON
+
+static void select_neon(void) {
+	b2v_expand_1bpp = expand_1bpp_neon;
+	b2v_pack_1bpp = pack_1bpp_neon;
+	b2v_reverse_bytes = reverse_bytes_neon;
+	b2v_spread_bits = spread_bits_neon;
+	b2v_gather_bits = gather_bits_neon;
+	upscale_kernels[2] = upscale_neon_2;
+	upscale_kernels[3] = upscale_neon_3;
+	upscale_kernels[4] = upscale_neon_4;
+	upscale_kernels[5] = upscale_neon_5;
+	upscale_kernels[6] = upscale_neon_6;
+	upscale_kernels[7] = upscale_neon_7;
+	upscale_kernels[8] = upscale_neon_8;
+	upscale_kernels[9] = upscale_neon_9;
+	upscale_kernels[10] = upscale_neon_10;
+	upscale_generic = upscale_generic_neon;
+	b2v_encode_gather = encode_gather_neon;
+}
+
+#endif
+
+// Sets of kernels, from the slowest to the fastest. Selecting a set also
+// selects the kernels of every set before it that the CPU supports, so a
+// later set only has to replace the kernels it makes faster. Sets that are
+// slow on the current CPU are only used when asked for with --kernel.
+static const struct {
+	const char *name;
+	bool (*supported)(void);
+	void (*select)(void);
+	bool (*slow)(void); // NULL if never slow
+} kernel_sets[] = {
+	{ "scalar", supports_all, select_scalar, NULL },
+#if B2V_X86
+	{ "sse2", supports_sse2, select_sse2, NULL },
+	{ "ssse3", supports_ssse3, select_ssse3, NULL },
+	{ "avx2", supports_avx2, select_avx2, NULL },
+#if defined(__x86_64__)
+	{ "bmi2", supports_bmi2, select_bmi2, slow_bmi2 },
+#endif
+#endif
+#if B2V_NEON
+	{ "neon", supports_all, select_neon, NULL },
+#endif
+};
+
+#define KERNEL_SET_COUNT (int)(sizeof(kernel_sets) / sizeof(*kernel_sets))
+
+static int selected_set = -1;
+
+static int default_set(void) {
+	int set = 0;
+#if B2V_X86
+	__builtin_cpu_init();
+#endif
+	for (int i=1; i<KERNEL_SET_COUNT; i++) {
+		if (kernel_sets[i].supported() &&
+			((kernel_sets[i].slow == NULL) || !kernel_sets[i].slow()))
+		{
+			set = i;
+		}
+	}
+	return set;
+}
+
+// Runs the selected kernels on random data and compares the results with the
+// scalar versions. A kernel that doesn't match is replaced with the scalar
+// version.
+#define CHECK_SIZE 1024
+
+static void kernels_check(void) {
+	static uint8_t input[CHECK_SIZE + 64];
+	static uint8_t expected[CHECK_SIZE * 24], actual[CHECK_SIZE * 24];
+	uint32_t seed = 0x62327621;
+	for (int i=0; i<CHECK_SIZE + 64; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		input[i] = seed & 0xFF;
+	}
+	const char *set = kernel_sets[selected_set].name;
+
+	#define CHECK(name, bytes, call_scalar, call_kernel, fallback) \
+		memset(expected, 0, bytes); \
+		memset(actual, 0, bytes); \
+		call_scalar; \
+		call_kernel; \
+		if (memcmp(expected, actual, bytes) != 0) { \
+			fprintf(stderr, "warning: %s kernels failed the self-check for %s, " \
+				"using the scalar version instead\n", set, name); \
+			fallback; \
+		}
+
+	for (int rev=0; rev<2; rev++) {
+		CHECK("1-bpp expansion", (CHECK_SIZE - 1) * 24,
+			b2v_expand_1bpp_scalar(expected, input, CHECK_SIZE - 1, rev),
+			b2v_expand_1bpp(actual, input, CHECK_SIZE - 1, rev),
+			b2v_expand_1bpp = b2v_expand_1bpp_scalar)
+		CHECK("1-bpp packing", CHECK_SIZE / 24 - 1,
+			b2v_pack_1bpp_scalar(expected, input, CHECK_SIZE / 24 - 1, rev),
+			b2v_pack_1bpp(actual, input, CHECK_SIZE / 24 - 1, rev),
+			b2v_pack_1bpp = b2v_pack_1bpp_scalar)
+		CHECK("bit spreading", (CHECK_SIZE - 1) * 8,
+			b2v_spread_bits_scalar(expected, input, CHECK_SIZE - 1, rev),
+			b2v_spread_bits(actual, input, CHECK_SIZE - 1, rev),
+			b2v_spread_bits = b2v_spread_bits_scalar)
+		CHECK("bit gathering", CHECK_SIZE / 8 - 1,
+			b2v_gather_bits_scalar(expected, input, CHECK_SIZE / 8 - 1, rev),
+			b2v_gather_bits(actual, input, CHECK_SIZE / 8 - 1, rev),
+			b2v_gather_bits = b2v_gather_bits_scalar)
+	}
+	CHECK("bit reversal", CHECK_SIZE - 1,
+		b2v_reverse_bytes_scalar(expected, input, CHECK_SIZE - 1),
+		b2v_reverse_bytes(actual, input, CHECK_SIZE - 1),
+		b2v_reverse_bytes = b2v_reverse_bytes_scalar)
+	if (b2v_encode_gather != NULL) {
+		for (int bits_per_pixel=2; bits_per_pixel<=23; bits_per_pixel++) {
+			size_t groups = CHECK_SIZE / bits_per_pixel;
+			CHECK("bit-gather encoding", groups * 24,
+				b2v_encode_gather_scalar(expected, input, groups, bits_per_pixel),
+				b2v_encode_gather(actual, input, groups, bits_per_pixel),
+				{ b2v_encode_gather = NULL; break; })
+		}
+	}
+	for (int bits_per_pixel=2; bits_per_pixel<=DECODE_GATHER_MAX;
+		bits_per_pixel++)
+	{
+		b2v_decode_gather_fn gather = decode_gather_kernels[bits_per_pixel];
+		if (gather != NULL) {
+			size_t groups = CHECK_SIZE / 24;
+			CHECK("bit-gather decoding", groups * bits_per_pixel,
+				b2v_decode_gather_scalar(expected, input, groups, bits_per_pixel),
+				gather(actual, input, groups, bits_per_pixel),
+				decode_gather_kernels[bits_per_pixel] = NULL)
+		}
+	}
+	int width = CHECK_SIZE / 3 - 1;
+	for (int scale=2; scale<=UPSCALE_MAX_PLAN; scale++) {
+		if (upscale_kernels[scale] != NULL) {
+			CHECK("upscaling", width * scale * 3,
+				b2v_upscale_scalar(expected, input, width, scale),
+				upscale_kernels[scale](actual, input, width, scale),
+				upscale_kernels[scale] = NULL)
+		}
+	}
+	// Block sizes without a plan
+	int scale = UPSCALE_MAX_PLAN + 3;
+	CHECK("upscaling", width * scale * 3,
+		b2v_upscale_scalar(expected, input, width, scale),
+		upscale_generic(actual, input, width, scale),
+		upscale_generic = b2v_upscale_scalar)
+
+	#undef CHECK
+}
+
+bool b2v_kernels_select(const char *name) {
+	static bool tables_ready = false;
+	if (!tables_ready) {
+		tables_ready = true;
+		tables_init();
+	}
+	int set = default_set();
+	if (name != NULL) {
+		for (set=0; set<KERNEL_SET_COUNT; set++) {
+			if (strcmp(kernel_sets[set].name, name) == 0) {
+				break;
+			}
+		}
+		if ((set == KERNEL_SET_COUNT) || !kernel_sets[set].supported()) {
+			return false;
+		}
+	}
+	for (int i=0; i<=set; i++) {
+		if (kernel_sets[i].supported()) {
+			kernel_sets[i].select();
+		}
+	}
+	selected_set = set;
+	kernels_check();
+	return true;
+}
+
+void b2v_kernels_list(FILE *file) {
+	int fastest = default_set();
+	for (int set=0; set<KERNEL_SET_COUNT; set++) {
+		bool slow = (kernel_sets[set].slow != NULL) && kernel_sets[set].slow();
+		fprintf(file, "%-8s%s\n", kernel_sets[set].name,
+			!kernel_sets[set].supported() ? "not supported" :
+			(set == fastest) ? "default" :
+			slow ? "supported, slow on this CPU" : "supported");
+	}
+}
+
+void b2v_kernels_init(void) {
+	if (selected_set == -1) {
+		b2v_kernels_select(NULL);
+	}
+}
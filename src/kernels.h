@@ -0,0 +1,141 @@
+#ifndef B2V_KERNELS_H
+#define B2V_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "bitstream.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__GNUC__) || defined(__clang__))
+#define B2V_X86 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define B2V_NEON 1
+#endif
+
+// Packs blocks [start, end) of an RGB24 image with data from the reader, and
+// stops after the block in which the reader runs out of data. Returns the
+// index of the first block that was not packed.
+typedef int (*b2v_encode_fn)(uint8_t *image, int start, int end,
+	struct b2v_bit_reader *reader);
+
+// Unpacks blocks [start, end) of an RGB24 image into buffer. A byte that is
+// not complete yet is kept in tbit and tbyte.
+typedef void (*b2v_decode_fn)(const uint8_t *image, int start, int end,
+	uint8_t *buffer, int *tbit, int *tbyte, int *buffer_idx);
+
+// Returns the kernels for the given bits-per-pixel (1 to 24) and bit order.
+b2v_encode_fn b2v_encode_kernel(int bits_per_pixel, bool rev);
+b2v_decode_fn b2v_decode_kernel(int bits_per_pixel, bool rev);
+
+// Same as the 1 bits-per-pixel kernels, for grayscale images with one byte
+// per block instead of three.
+b2v_encode_fn b2v_encode_gray_kernel(bool rev);
+b2v_decode_fn b2v_decode_gray_kernel(bool rev);
+
+// Expands every bit of input[0..bytes) into a black (0x00) or white (0xFF)
+// RGB24 pixel, writing bytes * 8 * 3 bytes to image. Bits are taken starting
+// from the least significant bit of each byte, or from the most significant
+// bit in Infinite-Storage-Glitch mode (rev).
+typedef void (*b2v_expand_1bpp_fn)(uint8_t *image, const uint8_t *input,
+	size_t bytes, bool rev);
+
+extern b2v_expand_1bpp_fn b2v_expand_1bpp;
+
+void b2v_expand_1bpp_scalar(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev);
+
+// The inverse of b2v_expand_1bpp_fn: packs every 8 RGB24 pixels of image into
+// one output byte, with a bit set for each pixel whose average is above 127.
+// Writes `bytes` bytes to output.
+typedef void (*b2v_pack_1bpp_fn)(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev);
+
+extern b2v_pack_1bpp_fn b2v_pack_1bpp;
+
+void b2v_pack_1bpp_scalar(uint8_t *output, const uint8_t *image, size_t bytes,
+	bool rev);
+
+// Reverses the bit order of every byte. 24-bpp blocks are the input bytes
+// with their bits reversed in normal mode, and exact copies in
+// Infinite-Storage-Glitch mode.
+typedef void (*b2v_reverse_fn)(uint8_t *dst, const uint8_t *src, size_t bytes);
+
+// Turns every bit of input[0..bytes) into a 0x00 or 0xFF byte, which is what
+// 3-bpp blocks look like. Writes bytes * 8 bytes to image.
+typedef void (*b2v_spread_fn)(uint8_t *image, const uint8_t *input,
+	size_t bytes, bool rev);
+
+// The inverse of b2v_spread_fn: packs every 8 bytes of image into one output
+// byte, with a bit set for each byte that is at least 128. Writes `bytes`
+// bytes to output.
+typedef void (*b2v_gather_fn)(uint8_t *output, const uint8_t *image,
+	size_t bytes, bool rev);
+
+extern b2v_reverse_fn b2v_reverse_bytes;
+extern b2v_spread_fn b2v_spread_bits;
+extern b2v_gather_fn b2v_gather_bits;
+
+void b2v_reverse_bytes_scalar(uint8_t *dst, const uint8_t *src, size_t bytes);
+void b2v_spread_bits_scalar(uint8_t *image, const uint8_t *input, size_t bytes,
+	bool rev);
+void b2v_gather_bits_scalar(uint8_t *output, const uint8_t *image, size_t bytes,
+	bool rev);
+
+// Packs groups of 8 blocks at bits-per-pixel values that don't line up with
+// whole bytes (2 to 23). Every group is stored in bits_per_pixel bytes of
+// input, with bits taken starting from the least significant bit of each
+// byte, and becomes 24 bytes of image.
+typedef void (*b2v_encode_gather_fn)(uint8_t *image, const uint8_t *input,
+	size_t groups, int bits_per_pixel);
+
+// NULL when the CPU has no gather kernel. The scalar version is only a
+// reference and a fallback for the last groups, the block by block encoder
+// is faster.
+extern b2v_encode_gather_fn b2v_encode_gather;
+
+void b2v_encode_gather_scalar(uint8_t *image, const uint8_t *input,
+	size_t groups, int bits_per_pixel);
+
+// The inverse of b2v_encode_gather_fn: unpacks every 24 bytes of image into
+// bits_per_pixel bytes of output.
+typedef void (*b2v_decode_gather_fn)(uint8_t *output, const uint8_t *image,
+	size_t groups, int bits_per_pixel);
+
+// Returns the gather decoder for the given bits-per-pixel, or NULL when the
+// CPU has none. There are decoders for 2 to 12 bits-per-pixel, the other
+// values are faster block by block. The scalar version is only a reference.
+b2v_decode_gather_fn b2v_decode_gather_kernel(int bits_per_pixel);
+
+void b2v_decode_gather_scalar(uint8_t *output, const uint8_t *image,
+	size_t groups, int bits_per_pixel);
+
+// Writes one line of a scaled image: each of the `width` RGB24 pixels in src
+// is repeated `scale` times.
+typedef void (*b2v_upscale_fn)(uint8_t *dst, const uint8_t *src, int width,
+	int scale);
+
+// Returns the fastest upscaler for the given block size.
+b2v_upscale_fn b2v_upscale_kernel(int scale);
+
+void b2v_upscale_scalar(uint8_t *dst, const uint8_t *src, int width, int scale);
+
+// The upscaler for grayscale lines, one byte per pixel
+void b2v_upscale_gray(uint8_t *dst, const uint8_t *src, int width, int scale);
+
+// Picks the fastest kernels supported by the CPU, unless b2v_kernels_select()
+// was called before.
+void b2v_kernels_init(void);
+
+// Picks a set of kernels by name ("scalar", "sse2", "ssse3", "avx2", "bmi2"
+// or "neon"), or the fastest set if name is NULL. Every kernel is checked
+// against its scalar version first. Returns false if there is no such set
+// or the CPU doesn't support it.
+bool b2v_kernels_select(const char *name);
+
+// Prints the sets of kernels and whether the CPU supports them.
+void b2v_kernels_list(FILE *file);
+
+#endif
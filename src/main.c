@@ -2,10 +2,12 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include "bin2video.h"
+#include "kernels.h"
 
 #define MINIMUM_BLOCK_COUNT 200
 #define STR(x) #x
@@ -57,11 +59,41 @@ void usage(char *argv0) {
 		"              height to limit the data blocks to a region on top of\n"
 		"              the video. The bottom of the region will be black.\n"
 		"              A value of -1 disables the data height. Defaults to %d.\n"
-		"              Cannot be used with -I.\n"
+		"              When decoding, only this region is read from the\n"
+		"              video, pass the value used for encoding. Cannot be\n"
+		"              used with -I.\n"
 		"  -s <size>   Size of each block. Defaults to %d.\n"
 		"  -I          Infinite-Storage-Glitch compatibility mode.\n"
 		"  -E          End the output with a black frame. Cannot be used with\n"
 		"              -I.\n"
+		"  --sample <mode>\n"
+		"              How blocks are read while decoding. \"average\" uses\n"
+		"              every pixel of a block, \"center\" only uses the pixel\n"
+		"              in the middle and \"core=<n>\" uses the n by n pixels\n"
+		"              in the middle. Center sampling is the fastest and is\n"
+		"              enough for lossless videos. Core sampling ignores the\n"
+		"              edges of blocks, where lossy codecs leave the most\n"
+		"              artifacts. Defaults to average.\n"
+		"  --combine   Decode the average of every copy of a frame written\n"
+		"              with -c, instead of only the first copy. This\n"
+		"              reduces errors with lossy codecs, but every copy has\n"
+		"              to be read.\n"
+		"  --ffmpeg-scale\n"
+		"              Have FFmpeg scale the blocks, so much less data goes\n"
+		"              through the pipe. When decoding, the video is scaled\n"
+		"              down to one pixel per block. This needs FFmpeg 5.1 or\n"
+		"              newer and average sampling. When encoding, frames are\n"
+		"              sent at a smaller size and FFmpeg scales them up and\n"
+		"              adds the region below the data height. The FFmpeg\n"
+		"              arguments cannot have video filters of their own.\n"
+		"  --yuv <444|420>\n"
+		"              Send frames to FFmpeg as yuv444p or yuv420p instead\n"
+		"              of RGB, with the levels of every block written\n"
+		"              straight into the Y, U and V planes. Use the format\n"
+		"              of the output video, so that no conversion takes\n"
+		"              place. 420 needs even block sizes. Has no effect at\n"
+		"              1 bit per pixel or when decoding, the format is\n"
+		"              stored in the video. Cannot be used with -I.\n"
 		"\n"
 		"ADVANCED OPTIONS:\n"
 		"  -S <size>   Sets the size of each block for the initial frame.\n"
@@ -70,6 +102,11 @@ void usage(char *argv0) {
 		"              while encoding, you will also need to do it while\n"
 		"              decoding. When -I is used, this value defaults to %d\n"
 		"              and cannot be changed.\n"
+		"  --kernel <name>\n"
+		"              Use the named set of optimized kernels instead of the\n"
+		"              fastest one supported by the CPU.\n"
+		"  --list-kernels\n"
+		"              List the sets of kernels and exit.\n"
 		"  --          Options following -- will be treated as arguments for\n"
 		"              FFmpeg. Defaults to \"%s\".\n"
 		"              Has no effect in decode mode.\n"
@@ -87,6 +124,27 @@ void usage(char *argv0) {
 	target = strtol(optarg, NULL, 10); \
 	if ((errno != 0) || (target < min)) USAGE(); \
 }
+
+// Long options without a short equivalent
+enum {
+	OPT_KERNEL = 0x80,
+	OPT_LIST_KERNELS,
+	OPT_SAMPLE,
+	OPT_COMBINE,
+	OPT_FFMPEG_SCALE,
+	OPT_YUV
+};
+
+static const struct option long_options[] = {
+	{ "kernel", required_argument, NULL, OPT_KERNEL },
+	{ "list-kernels", no_argument, NULL, OPT_LIST_KERNELS },
+	{ "sample", required_argument, NULL, OPT_SAMPLE },
+	{ "combine", no_argument, NULL, OPT_COMBINE },
+	{ "ffmpeg-scale", no_argument, NULL, OPT_FFMPEG_SCALE },
+	{ "yuv", required_argument, NULL, OPT_YUV },
+	{ NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char **argv) {
 	char *input_file = NULL;
 	char *output_file = NULL;
@@ -103,12 +161,20 @@ int main(int argc, char **argv) {
 	bool write_to_tty = false;
 	int framerate = DEFAULT_FRAMERATE;
 	bool isg_mode = false;
+	const char *kernel = NULL;
+	bool list_kernels = false;
+	int sample = B2V_SAMPLE_AVERAGE;
+	bool combine = false;
+	bool ffmpeg_scale = false;
+	int format = B2V_FORMAT_RGB;
 
 	int opt;
-	bool opts[0x80] = { 0 };
-	while ((opt = getopt(argc, argv, "f:b:w:h:s:S:i:o:detIH:c:E")) != -1) {
-		if (opts[opt & 0x7F]) USAGE();
-		opts[opt & 0x7F] = true;
+	bool opts[0x100] = { 0 };
+	while ((opt = getopt_long(argc, argv, "f:b:w:h:s:S:i:o:detIH:c:E",
+		long_options, NULL)) != -1)
+	{
+		if (opts[opt & 0xFF]) USAGE();
+		opts[opt & 0xFF] = true;
 		switch (opt) {
 			case 'b': NUM_ARG(bits_per_pixel, 1); break;
 			case 'w': NUM_ARG(width, 1); break;
@@ -137,6 +203,36 @@ int main(int argc, char **argv) {
 			case 'E': black_frame = true; break;
 			case 'o': output_file = optarg; break;
 			case 't': write_to_tty = true; break;
+			case OPT_KERNEL: kernel = optarg; break;
+			case OPT_LIST_KERNELS: list_kernels = true; break;
+			case OPT_SAMPLE:
+				if (strcmp(optarg, "average") == 0) {
+					sample = B2V_SAMPLE_AVERAGE;
+				}
+				else if (strcmp(optarg, "center") == 0) {
+					sample = B2V_SAMPLE_CENTER;
+				}
+				else if (strncmp(optarg, "core=", 5) == 0) {
+					optarg += 5;
+					NUM_ARG(sample, 1);
+				}
+				else {
+					USAGE();
+				}
+				break;
+			case OPT_COMBINE: combine = true; break;
+			case OPT_FFMPEG_SCALE: ffmpeg_scale = true; break;
+			case OPT_YUV:
+				if (strcmp(optarg, "444") == 0) {
+					format = B2V_FORMAT_YUV444;
+				}
+				else if (strcmp(optarg, "420") == 0) {
+					format = B2V_FORMAT_YUV420;
+				}
+				else {
+					USAGE();
+				}
+				break;
 			case 'd':
 			case 'e':
 				if (operation_mode != 0) USAGE();
@@ -171,9 +267,16 @@ int main(int argc, char **argv) {
 		encode_argv = default_encode_argv;
 	}
 
+	if (list_kernels) {
+		b2v_kernels_list(stdout);
+		return EXIT_SUCCESS;
+	}
 	if (operation_mode == 0) {
 		USAGE();
 	}
+	if ((kernel != NULL) && !b2v_kernels_select(kernel)) {
+		DIE("unknown kernel or not supported by this CPU, see --list-kernels");
+	}
 	if ((bits_per_pixel < 0) || (bits_per_pixel > 24)) {
 		DIE("bits-per-pixel must be in the range [0..24]")
 	}
@@ -188,7 +291,9 @@ int main(int argc, char **argv) {
 	if ((width % 2 != 0) || (height % 2 != 0)) {
 		DIE("width and height must be divisible by 0");
 	}
-	if (data_height <= 0) {
+	// The video being decoded has its own height, which is only known later
+	int decode_data_height = data_height;
+	if ((data_height <= 0) || (operation_mode == 'd')) {
 		data_height = height;
 	}
 	else if (data_height >= height) {
@@ -220,15 +325,28 @@ int main(int argc, char **argv) {
 			if ((output_file == NULL) && isatty(STDOUT_FILENO) && !write_to_tty) {
 				DIE("refusing to write binary data to tty");
 			}
-			ret = b2v_decode(input_file, output_file, initial_block_size, isg_mode);
+			if (ffmpeg_scale && (sample != B2V_SAMPLE_AVERAGE)) {
+				DIE("--ffmpeg-scale only works with average sampling");
+			}
+			ret = b2v_decode(input_file, output_file, initial_block_size,
+				decode_data_height, sample, combine, ffmpeg_scale, isg_mode);
 			break;
 		case 'e':
 			if (output_file == NULL) {
 				DIE("output file cannot be stdout in encode mode");
 			}
+			if (isg_mode && (format != B2V_FORMAT_RGB)) {
+				DIE("--yuv cannot be used with -I");
+			}
+			if ((format == B2V_FORMAT_YUV420) && ((block_size % 2 != 0) ||
+				(initial_block_size % 2 != 0)))
+			{
+				DIE("--yuv 420 needs the initial and real block size to be even");
+			}
 			ret = b2v_encode(input_file, output_file, width, height,
 				initial_block_size, block_size, bits_per_pixel, framerate,
-				encode_argv, isg_mode, data_height, frame_write, black_frame);
+				encode_argv, isg_mode, data_height, frame_write, black_frame,
+				ffmpeg_scale, format);
 			break;
 		default:
 			DIE("impossible condition: operation_mode is not valid");
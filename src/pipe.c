@@ -0,0 +1,197 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // F_SETPIPE_SZ, vmsplice()
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if !defined(_WIN32)
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#endif
+#include "pipe.h"
+
+// Pipes can't be made smaller than a page
+#define PIPE_MIN_SIZE (4 << 10)
+
+// The pipe to ffmpeg is made at most this large
+#define WRITE_PIPE_SIZE (1 << 20)
+
+// Copies of a frame handed over in one writev() or vmsplice() call, at most
+#define WRITE_IOV_MAX 16
+
+void *b2v_pipe_alloc(size_t size) {
+#if !defined(_WIN32)
+	void *buffer;
+	if (posix_memalign(&buffer, PIPE_MIN_SIZE, size) == 0) {
+		return buffer;
+	}
+#endif
+	return malloc(size);
+}
+
+size_t b2v_pipe_grow(int fd, size_t size) {
+#if defined(F_SETPIPE_SZ)
+	// Unprivileged processes can't go above /proc/sys/fs/pipe-max-size, try
+	// smaller sizes until one fits
+	for (; size >= PIPE_MIN_SIZE; size /= 2) {
+		int ret = fcntl(fd, F_SETPIPE_SZ, (int)size);
+		if (ret != -1) {
+			return (size_t)ret;
+		}
+		if (errno != EPERM) {
+			break;
+		}
+	}
+#else
+	(void)fd;
+	(void)size;
+#endif
+	return 0;
+}
+
+void b2v_pipe_reader_init(struct b2v_pipe_reader *reader, int fd,
+	size_t pipe_size)
+{
+	reader->fd = fd;
+	reader->eof = false;
+	reader->error = false;
+	b2v_pipe_grow(fd, pipe_size);
+}
+
+size_t b2v_pipe_read(struct b2v_pipe_reader *reader, void *buffer,
+	size_t size)
+{
+	size_t done = 0;
+	while (!reader->eof && (done < size)) {
+		ssize_t bytes_read = read(reader->fd, (uint8_t *)buffer + done,
+			size - done);
+		if ((bytes_read == -1) && (errno == EINTR)) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			if (bytes_read == -1) {
+				perror("couldn't read from ffmpeg");
+				reader->error = true;
+			}
+			reader->eof = true;
+			break;
+		}
+		done += bytes_read;
+	}
+	return done;
+}
+
+void b2v_pipe_writer_init(struct b2v_pipe_writer *writer, int fd,
+	size_t frame_size)
+{
+	writer->fd = fd;
+	writer->splice = false;
+#if defined(_WIN32)
+	(void)frame_size;
+	writer->blocked = -1;
+#else
+	writer->blocked = 0;
+	// The pipe is only written to when there is room, so the time spent
+	// waiting for room can be measured
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	// A frame buffer can only be changed once the pipe doesn't refer to it
+	// anymore. Writing a frame that is at least as large as the pipe pushes
+	// every page of the frame before it out of the pipe.
+	size_t pipe_size = WRITE_PIPE_SIZE;
+	while ((pipe_size > frame_size) && (pipe_size > PIPE_MIN_SIZE)) {
+		pipe_size /= 2;
+	}
+	pipe_size = b2v_pipe_grow(fd, pipe_size);
+#if defined(__linux__)
+	writer->splice = (pipe_size != 0) && (pipe_size <= frame_size);
+#else
+	(void)pipe_size;
+#endif
+#endif
+}
+
+#if !defined(_WIN32)
+
+// Blocks until there is room in the pipe
+static void pipe_wait(struct b2v_pipe_writer *writer) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct pollfd pfd = { .fd = writer->fd, .events = POLLOUT };
+	while ((poll(&pfd, 1, -1) == -1) && (errno == EINTR));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	writer->blocked += (double)(end.tv_sec - start.tv_sec) +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int b2v_pipe_write(struct b2v_pipe_writer *writer, const void *frame,
+	size_t size, int count)
+{
+	uint64_t total = (uint64_t)size * count;
+	uint64_t done = 0;
+	while (done < total) {
+		// The copies that are left, starting where the last call stopped
+		struct iovec iov[WRITE_IOV_MAX];
+		int iov_count = 0;
+		for (uint64_t pos = done; (pos < total) && (iov_count < WRITE_IOV_MAX);
+			iov_count++)
+		{
+			size_t offset = pos % size;
+			iov[iov_count].iov_base = (uint8_t *)frame + offset;
+			iov[iov_count].iov_len = size - offset;
+			pos += size - offset;
+		}
+		ssize_t written;
+#if defined(__linux__)
+		if (writer->splice) {
+			written = vmsplice(writer->fd, iov, iov_count, SPLICE_F_NONBLOCK);
+		}
+		else
+#endif
+		{
+			written = writev(writer->fd, iov, iov_count);
+		}
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				pipe_wait(writer);
+				continue;
+			}
+			perror("couldn't write to ffmpeg");
+			return -1;
+		}
+		done += written;
+	}
+	return 0;
+}
+
+#else
+
+int b2v_pipe_write(struct b2v_pipe_writer *writer, const void *frame,
+	size_t size, int count)
+{
+	for (int i=0; i<count; i++) {
+		size_t done = 0;
+		while (done < size) {
+			int written = write(writer->fd, (const uint8_t *)frame + done,
+				size - done);
+			if (written == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("couldn't write to ffmpeg");
+				return -1;
+			}
+			done += written;
+		}
+	}
+	return 0;
+}
+
+#endif
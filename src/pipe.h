@@ -0,0 +1,56 @@
+#ifndef B2V_PIPE_H
+#define B2V_PIPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Raw frames coming from ffmpeg. The pipe is read with blocking read() calls
+// straight into the frame buffers, without stdio in between. The end of the
+// stream is the end of the file, the process doesn't need to be polled.
+struct b2v_pipe_reader {
+	int fd;
+	bool eof;
+	bool error; // the stream ended because read() failed
+};
+
+// Raw frames going to ffmpeg. Frames are written with writev(), without
+// stdio in between, and every copy of a repeated frame goes out in the same
+// call. On Linux, frames at least as large as the pipe are handed over with
+// vmsplice() instead, so the pipe refers to the frame buffer instead of a
+// copy of it.
+struct b2v_pipe_writer {
+	int fd;
+	bool splice;
+	double blocked; // seconds spent waiting for ffmpeg, -1 if unknown
+};
+
+// Allocates a frame buffer, aligned to a page where possible so vmsplice()
+// can hand over whole pages. Freed with free().
+void *b2v_pipe_alloc(size_t size);
+
+// Makes the pipe behind fd hold up to `size` bytes, or as much as the system
+// allows below that. Returns the new capacity, or 0 if it couldn't be
+// changed.
+size_t b2v_pipe_grow(int fd, size_t size);
+
+// Reads from fd, which is grown to pipe_size bytes first.
+void b2v_pipe_reader_init(struct b2v_pipe_reader *reader, int fd,
+	size_t pipe_size);
+
+// Reads `size` bytes into buffer, blocking until they all arrive. Returns
+// fewer bytes only if the stream ends first, and 0 once it has ended. A
+// failed read also ends the stream and sets reader->error.
+size_t b2v_pipe_read(struct b2v_pipe_reader *reader, void *buffer,
+	size_t size);
+
+// Writes to fd, frames will be frame_size bytes.
+void b2v_pipe_writer_init(struct b2v_pipe_writer *writer, int fd,
+	size_t frame_size);
+
+// Writes `count` copies of the frame. With writer->splice, the frame must not
+// change until another frame has been written after it. Returns 0 on
+// success.
+int b2v_pipe_write(struct b2v_pipe_writer *writer, const void *frame,
+	size_t size, int count);
+
+#endif